@@ -0,0 +1,43 @@
+#ifndef ACCEL_FACTORY_H
+#define ACCEL_FACTORY_H
+
+#include "bvh.h"
+#include "sah_bvh.h"
+#include <string>
+
+/**
+ * Runtime selection of the top level acceleration structure
+*/
+enum accel_type
+{
+    OCTREE_ACCEL,
+    SAH_ACCEL
+};
+
+inline shared_ptr<accel> make_accel(accel_type type)
+{
+    switch (type)
+    {
+    case SAH_ACCEL:
+        return make_shared<SAH_BVH>();
+    case OCTREE_ACCEL:
+    default:
+        return make_shared<BVH>();
+    }
+}
+
+/**
+ * @return: false if name is not a known acceleration structure
+*/
+inline bool parse_accel_type(const std::string &name, accel_type &type)
+{
+    if (name == "octree")
+        type = OCTREE_ACCEL;
+    else if (name == "sah")
+        type = SAH_ACCEL;
+    else
+        return false;
+    return true;
+}
+
+#endif
@@ -1,20 +1,103 @@
 #ifndef ACCELERATION_H
 #define ACCELERATION_H
 #include "hittable.h"
+#include "material_table.h"
+#include <atomic>
+#include <cmath>
+#include <ostream>
+#include <string>
 #include <vector>
 using namespace std;
 /**
  * Acceleration Structure.
- * Currently being used for tlas
- * but can probably reuse for Bottom level as well
+ * Used for the tlas over scene objects,
+ * meshes build their blas with the sah_builder directly
+ * Compile with -DACCEL_STATS to count node visits per ray
 */
 
 class accel : public hittable
 {
 public:
     virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
+    // must be called after adding all objects
+    virtual void set_up_bvh() = 0;
+    virtual std::string name() const = 0;
     virtual ~accel(){};
+
+    void add(shared_ptr<hittable> object)
+    {
+        object->register_materials(materials);
+        objects.push_back(object);
+    }
+
+    // objects with an emissive material, for next event estimation
+    std::vector<shared_ptr<hittable>> lights() const
+    {
+        std::vector<shared_ptr<hittable>> emitters;
+        for (const auto &object : objects)
+        {
+            if (object->is_emissive())
+                emitters.push_back(object);
+        }
+        return emitters;
+    }
+
+    void print_stats(std::ostream &out) const
+    {
+        out << name() << ": build time " << build_time_ms << " ms";
+#if ACCEL_STATS
+        unsigned long long rays = num_rays.load();
+        out << ", rays " << rays << ", average node visits per ray "
+            << (rays ? static_cast<double>(num_node_visits.load()) / rays : 0.0);
+#endif
+        out << '\n';
+    }
+
     std::vector<shared_ptr<hittable>> objects;
+    material_table materials; // materials of the objects, by the ids in their hit records
+    double build_time_ms = 0;
+    unsigned int build_threads = 0; // threads set_up_bvh builds on, 0 for one per hardware thread
+
+protected:
+#if ACCEL_STATS
+    mutable std::atomic<unsigned long long> num_rays{0};
+    mutable std::atomic<unsigned long long> num_node_visits{0};
+#endif
+    // called once per traversal so the counters are only touched once per ray or packet
+    void record_traversal(unsigned long long node_visits, unsigned int rays = 1) const
+    {
+#if ACCEL_STATS
+        num_rays.fetch_add(rays, std::memory_order_relaxed);
+        num_node_visits.fetch_add(node_visits, std::memory_order_relaxed);
+#else
+        (void)node_visits;
+        (void)rays;
+#endif
+    }
 };
 
-#endif
\ No newline at end of file
+inline unsigned int lane_count(int mask)
+{
+    unsigned int count = 0;
+    for (; mask; mask &= mask - 1)
+        ++count;
+    return count;
+}
+
+/**
+ * Conservative double to float conversion for node bounds,
+ * so that the compact bounds always enclose the exact ones
+*/
+inline float round_down(double d)
+{
+    float f = static_cast<float>(d);
+    return (f > d) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up(double d)
+{
+    float f = static_cast<float>(d);
+    return (f < d) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+#endif
@@ -4,9 +4,13 @@
 #include "acceleration.h"
 #include "interval.h"
 #include "material.h"
+#include "scheduler.h"
+#include <chrono>
 #include <queue>
 
 #define MAX_DEPTH 16
+// every interior level pushes at most 8 children while popping one
+#define TRAVERSAL_STACK_SIZE (8 * (MAX_DEPTH + 1))
 /**
  * TLAS: Top Level Acceleration Structure
  * Should mimic hittable_list since that is what we will be replacing:
@@ -54,7 +58,7 @@ private:
         }
     };
 
-    bbox *objects_bounds;
+    bbox *objects_bounds = nullptr;
 
     struct octnode
     {
@@ -92,15 +96,6 @@ private:
         {
             build(root, octree_bounds);
         }
-        //structure to optimize ending ending traversal if closest object intersected in found
-        struct QE
-        {
-            const octnode *node;
-            double t;
-            QE(const octnode *n, double key) : node(n), t(key) {}
-            friend bool operator<(const QE &a, const QE &b) { return a.t > b.t; }
-        };
-
     private:
         void insert(octnode *node, const bbox *box, vec3 (&bounds)[2], int depth)
         {
@@ -195,37 +190,190 @@ private:
         }
     };
 
-    octree *tree = nullptr;
+    /**
+     * Ray side of the slab tests, computed once per ray
+     * plane intersection equation: f(d) = (d - N.O)/(N.RD), so N.O and 1/(N.RD) are all a node test needs
+    */
+    struct slab_ray
+    {
+#if SIMD_VECTORIZED
+        vdouble4 NdotOrig[2];
+        vdouble4 inv_NdotDir[2]; // lane 3 of the second half is 1, so the padding slab of a node stays (-inf, inf)
+#else
+        double NdotOrig[num_plane_set_normals];
+        double inv_NdotDir[num_plane_set_normals];
+#endif
+        slab_ray(const double *NdotOrig_, const double *NdotDir)
+        {
+#if SIMD_VECTORIZED
+            NdotOrig[0] = vdouble4::load(NdotOrig_);
+            NdotOrig[1] = vdouble4(NdotOrig_[4], NdotOrig_[5], NdotOrig_[6], 0);
+            inv_NdotDir[0] = vdouble4(1.0) / vdouble4::load(NdotDir);
+            inv_NdotDir[1] = vdouble4(1.0) / vdouble4(NdotDir[4], NdotDir[5], NdotDir[6], 1);
+#else
+            for (size_t i = 0; i < num_plane_set_normals; ++i)
+            {
+                NdotOrig[i] = NdotOrig_[i];
+                inv_NdotDir[i] = 1 / NdotDir[i];
+            }
+#endif
+        }
+    };
+
+    /**
+     * Octree node after compaction (72 bytes).
+     * Nodes are laid out depth first with the children of a node stored contiguously.
+     * The 7 slabs are padded to 8 with an infinite one, so the bounds load as two vectors
+    */
+    struct flat_node
+    {
+        float bounds_min[num_plane_set_normals + 1];
+        float bounds_max[num_plane_set_normals + 1];
+        unsigned int offset;      // leaf: first entry in leaf_objects, interior: index of the first child
+        unsigned int count : 31;  // number of leaf objects or children
+        unsigned int is_leaf : 1;
+
+        /**
+         * Slab test of a single ray against all 7 plane sets, see slab_ray
+        */
+        bool hit(const slab_ray &sr, double &tnear, double &tfar) const
+        {
+#if SIMD_VECTORIZED
+            //slabs 0-3 and 4-7 as two 4 wide halves, the padding slab 7 never limits the interval
+            vdouble4 t0 = (vdouble4::load(bounds_min) - sr.NdotOrig[0]) * sr.inv_NdotDir[0];
+            vdouble4 t1 = (vdouble4::load(bounds_max) - sr.NdotOrig[0]) * sr.inv_NdotDir[0];
+            vdouble4 t2 = (vdouble4::load(bounds_min + 4) - sr.NdotOrig[1]) * sr.inv_NdotDir[1];
+            vdouble4 t3 = (vdouble4::load(bounds_max + 4) - sr.NdotOrig[1]) * sr.inv_NdotDir[1];
+            vdouble4 tn = max(min(t0, t1), min(t2, t3));
+            vdouble4 tf = min(max(t0, t1), max(t2, t3));
+            tnear = std::max(tnear, hmax(tn));
+            tfar = std::min(tfar, hmin(tf));
+            return tnear <= tfar;
+#else
+            for (size_t i = 0; i < num_plane_set_normals; ++i)
+            {
+                double tn = (bounds_min[i] - sr.NdotOrig[i]) * sr.inv_NdotDir[i];
+                double tf = (bounds_max[i] - sr.NdotOrig[i]) * sr.inv_NdotDir[i];
+                if (sr.inv_NdotDir[i] < 0)
+                    std::swap(tn, tf);
+                if (tn > tnear)
+                    tnear = tn;
+                if (tf < tfar)
+                    tfar = tf;
+                if (tnear > tfar)
+                    return false;
+            }
+            return true;
+#endif
+        }
+
+        /**
+         * Slab test of all packet lanes against the node, inv_NdotDir holds 1 / N.RD per lane
+         * @return: mask of lanes entering the node, tnear holds their entry distances
+        */
+        int hit(const vdouble4 *NdotOrig, const vdouble4 *inv_NdotDir, vdouble4 tmin, vdouble4 tmax, vdouble4 &tnear) const
+        {
+            for (size_t i = 0; i < num_plane_set_normals; ++i)
+            {
+                vdouble4 tn = (vdouble4(bounds_min[i]) - NdotOrig[i]) * inv_NdotDir[i];
+                vdouble4 tf = (vdouble4(bounds_max[i]) - NdotOrig[i]) * inv_NdotDir[i];
+                tmin = max(tmin, min(tn, tf));
+                tmax = min(tmax, max(tn, tf));
+            }
+            tnear = tmin;
+            return movemask(tmin <= tmax);
+        }
+    };
+
+    std::vector<flat_node> nodes;
+    std::vector<const hittable *> leaf_objects; // objects referenced by leaves, owned by objects
+
+    //structure to optimize ending ending traversal if closest object intersected in found
+    struct QE
+    {
+        unsigned int node;
+        double t;
+        QE() {}
+        QE(unsigned int n, double key) : node(n), t(key) {}
+        friend bool operator<(const QE &a, const QE &b) { return a.t > b.t; }
+    };
+
+    /**
+     * Writes node and its subtree into the flat arrays, node itself must already have a slot at node_index
+    */
+    void flatten(const octnode *node, unsigned int node_index)
+    {
+        flat_node &flat = nodes[node_index];
+        for (size_t i = 0; i < num_plane_set_normals; ++i)
+        {
+            flat.bounds_min[i] = round_down(node->box.bounds[i].min);
+            flat.bounds_max[i] = round_up(node->box.bounds[i].max);
+        }
+        flat.bounds_min[num_plane_set_normals] = -infinity;
+        flat.bounds_max[num_plane_set_normals] = infinity;
+        flat.is_leaf = node->is_leaf;
+        if (node->is_leaf)
+        {
+            flat.offset = leaf_objects.size();
+            flat.count = node->data.size();
+            for (const bbox *box : node->data)
+                leaf_objects.push_back(objects[box - objects_bounds].get());
+            return;
+        }
+        const octnode *children[8];
+        unsigned int num_children = 0;
+        for (const octnode *child : node->children)
+        {
+            if (child)
+                children[num_children++] = child;
+        }
+        unsigned int first_child = nodes.size();
+        flat.offset = first_child;
+        flat.count = num_children;
+        nodes.resize(nodes.size() + num_children); // invalidates flat
+        for (unsigned int i = 0; i < num_children; ++i)
+            flatten(children[i], first_child + i);
+    }
 
 public:
     BVH() {}
-    ~BVH() { delete tree; }
-    void add(shared_ptr<hittable> object)
+    ~BVH()
     {
-        objects.push_back(object);
+        delete[] objects_bounds;
     }
+    std::string name() const override { return "octree bvh"; }
 
     // must be called after adding all objects
-    void set_up_bvh()
+    void set_up_bvh() override
     {
+        auto start = std::chrono::high_resolution_clock::now();
         bbox scene_box;
+        delete[] objects_bounds;
         objects_bounds = new bbox[objects.size()];
-        //calculate bounds for each object
+        //calculate bounds for each object, one task per object and plane set normal
+        scheduler pool(build_threads);
+        pool.parallel_for(num_plane_set_normals * objects.size(), [&](unsigned int task)
+                          {
+                              size_t i = task / num_plane_set_normals, j = task % num_plane_set_normals;
+                              objects[i]->compute_bounds(plane_set_normals[j], objects_bounds[i].bounds[j].min, objects_bounds[i].bounds[j].max); });
         for (size_t i = 0; i < objects.size(); ++i)
         {
-            for (size_t j = 0; j < num_plane_set_normals; ++j)
-            {
-                objects[i]->compute_bounds(plane_set_normals[j], objects_bounds[i].bounds[j].min, objects_bounds[i].bounds[j].max);
-            }
             objects_bounds[i].bounded_object = objects[i];
             scene_box.extend_bounds(objects_bounds[i]);
         }
-        tree = new octree(scene_box);
+        octree tree(scene_box);
         for (size_t i = 0; i < objects.size(); ++i)
         {
-            tree->insert(objects_bounds + i);
+            tree.insert(objects_bounds + i);
         }
-        tree->build();
+        tree.build();
+        //compact into the flat arrays, the pointer based octree is freed when tree goes out of scope
+        nodes.clear();
+        leaf_objects.clear();
+        nodes.resize(1);
+        flatten(tree.root, 0);
+        auto stop = std::chrono::high_resolution_clock::now();
+        build_time_ms = std::chrono::duration<double, std::milli>(stop - start).count();
     }
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
@@ -234,6 +382,7 @@ public:
         //tnearest = f(dnearest), tfarthest = f(dfarthest);;; N = Normal, RD = ray direction
         //precompute N.O and N.RD
         bool hit_any_objects = false;
+        unsigned long long node_visits = 0;
         double NdotOrig[num_plane_set_normals];
         double NdotDir[num_plane_set_normals];
         for (size_t i = 0; i < num_plane_set_normals; ++i)
@@ -250,11 +399,12 @@ public:
         {
             double tnear = ray_t.min, tfar = tclosest_object_so_far;
             size_t pi;
+            ++node_visits;
             if (objects_bounds[i].hit(NdotOrig, NdotDir, tnear, tfar, pi))
             {
                 if (tnear < tclosest_object_so_far) //cloest bounding box hit
                 {
-                    if (objects[i]->hit(r, ray_t, temp_rec))
+                    if (objects[i]->hit(r, interval(ray_t.min, tclosest_object_so_far), temp_rec))
                     {
                         hit_any_objects = true;
                         tclosest_object_so_far = temp_rec.t;
@@ -266,27 +416,30 @@ public:
 
 #else
         //add octree logic:
-        size_t pi = 0;
         double tnear = 0, tfar = ray_t.max;
-        if (!tree->root->box.hit(NdotOrig, NdotDir, tnear, tfar, pi) || tfar < 0 || tnear > ray_t.max)
+        slab_ray sr(NdotOrig, NdotDir);
+        if (!nodes[0].hit(sr, tnear, tfar) || tfar < 0 || tnear > ray_t.max)
         {
             // no intersection with the collection of objects/scene
+            record_traversal(0);
             return false;
         }
         double t_min = tfar;
-        std::priority_queue<BVH::octree::QE> que;
-        que.push(BVH::octree::QE(tree->root, 0));
+#if PRIORITY_QUEUE_TRAVERSAL
+        std::priority_queue<BVH::QE> que;
+        que.push(BVH::QE(0, 0));
         //now basically bfs::
         while (!que.empty() && que.top().t < t_min)
         {
-            const octnode *node = que.top().node;
+            const flat_node &node = nodes[que.top().node];
             que.pop();
-            if (node->is_leaf)
+            ++node_visits;
+            if (node.is_leaf)
             {
-                for (size_t i = 0; i < node->data.size(); ++i)
+                for (unsigned int i = node.offset; i < node.offset + node.count; ++i)
                 {
                     hit_record temp_record;
-                    if (node->data[i]->bounded_object->hit(r, ray_t, temp_record))
+                    if (leaf_objects[i]->hit(r, ray_t, temp_record))
                     {
                         if (temp_record.t < t_min)
                         {
@@ -299,23 +452,183 @@ public:
             }
             else
             {
-                for (size_t i = 0; i < 8; ++i)
+                for (unsigned int i = node.offset; i < node.offset + node.count; ++i)
                 {
-                    if (node->children[i] != NULL)
+                    double tnear_child = 0, tfar_child = tfar;
+                    if (nodes[i].hit(sr, tnear_child, tfar_child))
                     {
-                        double tnear_child = 0, tfar_child = tfar;
-                        if (node->children[i]->box.hit(NdotOrig, NdotDir, tnear_child, tfar_child, pi))
-                        {
-                            double t = (tnear_child < 0 && tfar_child >= 0) ? tfar_child : tnear_child;
-                            que.push(BVH::octree::QE(node->children[i], t));
-                        }
+                        double t = (tnear_child < 0 && tfar_child >= 0) ? tfar_child : tnear_child;
+                        que.push(BVH::QE(i, t));
+                    }
+                }
+            }
+        }
+#else
+        //depth first on a fixed size stack, no allocations per ray
+        //children are pushed far to near so the nearest one is popped first
+        QE stack[TRAVERSAL_STACK_SIZE];
+        int stack_size = 0;
+        stack[stack_size++] = BVH::QE(0, tnear);
+        hit_record temp_record;
+        while (stack_size)
+        {
+            QE entry = stack[--stack_size];
+            if (entry.t >= t_min)
+                continue; //closest hit so far is in front of this node
+            const flat_node &node = nodes[entry.node];
+            ++node_visits;
+            if (node.is_leaf)
+            {
+                for (unsigned int i = node.offset; i < node.offset + node.count; ++i)
+                {
+                    if (leaf_objects[i]->hit(r, interval(ray_t.min, t_min), temp_record))
+                    {
+                        t_min = temp_record.t;
+                        hit_any_objects = true;
+                        rec = temp_record;
                     }
                 }
+                continue;
+            }
+            int first = stack_size;
+            for (unsigned int i = node.offset; i < node.offset + node.count; ++i)
+            {
+                double tnear_child = 0, tfar_child = t_min;
+                if (nodes[i].hit(sr, tnear_child, tfar_child))
+                {
+                    //insertion sort by decreasing distance
+                    int j = stack_size++;
+                    for (; j > first && stack[j - 1].t < tnear_child; --j)
+                        stack[j] = stack[j - 1];
+                    stack[j] = BVH::QE(i, tnear_child);
+                }
             }
         }
 #endif
+#endif
+        record_traversal(node_visits);
         return hit_any_objects;
     }
+
+    /**
+     * Packet traversal: all lanes share every node fetch, a node is entered
+     * if any of the lanes still active in it hits its bounds
+    */
+    int hit_packet(const ray_packet &packet, int active, double *t_max, hit_record *recs) const override
+    {
+#if DISABLE_SPACE_PARTITION
+        return hittable::hit_packet(packet, active, t_max, recs);
+#else
+        vdouble4 NdotOrig[num_plane_set_normals];
+        vdouble4 inv_NdotDir[num_plane_set_normals];
+        for (size_t i = 0; i < num_plane_set_normals; ++i)
+        {
+            const vec3 &n = plane_set_normals[i];
+            NdotOrig[i] = packet.orig[0] * n.x() + packet.orig[1] * n.y() + packet.orig[2] * n.z();
+            inv_NdotDir[i] = vdouble4(1.0) / (packet.dir[0] * n.x() + packet.dir[1] * n.y() + packet.dir[2] * n.z());
+        }
+        struct packet_entry
+        {
+            unsigned int node;
+            int mask; // lanes that entered the node
+            double t; // nearest entry distance among them
+        };
+        packet_entry stack[TRAVERSAL_STACK_SIZE];
+        int stack_size = 0;
+        unsigned long long node_visits = 0;
+        int hit_mask = 0;
+        vdouble4 tnear;
+        int root_mask = nodes[0].hit(NdotOrig, inv_NdotDir, vdouble4(packet.t_min), vdouble4::load(t_max), tnear) & active;
+        if (root_mask)
+            stack[stack_size++] = {0, root_mask, lane_min(tnear, root_mask)};
+        while (stack_size)
+        {
+            packet_entry entry = stack[--stack_size];
+            if (entry.t >= lane_max(t_max, entry.mask))
+                continue; //every lane already has a closer hit
+            const flat_node &node = nodes[entry.node];
+            ++node_visits;
+            if (node.is_leaf)
+            {
+                for (unsigned int i = node.offset; i < node.offset + node.count; ++i)
+                    hit_mask |= leaf_objects[i]->hit_packet(packet, entry.mask, t_max, recs);
+                continue;
+            }
+            vdouble4 t_max_lanes = vdouble4::load(t_max);
+            int first = stack_size;
+            for (unsigned int i = node.offset; i < node.offset + node.count; ++i)
+            {
+                int child_mask = nodes[i].hit(NdotOrig, inv_NdotDir, vdouble4(packet.t_min), t_max_lanes, tnear) & entry.mask;
+                if (child_mask)
+                {
+                    //insertion sort by decreasing distance
+                    double t = lane_min(tnear, child_mask);
+                    int j = stack_size++;
+                    for (; j > first && stack[j - 1].t < t; --j)
+                        stack[j] = stack[j - 1];
+                    stack[j] = {i, child_mask, t};
+                }
+            }
+        }
+        record_traversal(node_visits, lane_count(active));
+        return hit_mask;
+#endif
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        unsigned long long node_visits = 0;
+        double NdotOrig[num_plane_set_normals];
+        double NdotDir[num_plane_set_normals];
+        for (size_t i = 0; i < num_plane_set_normals; ++i)
+        {
+            NdotOrig[i] = dot(plane_set_normals[i], r.origin());
+            NdotDir[i] = dot(plane_set_normals[i], r.direction());
+        }
+#if DISABLE_SPACE_PARTITION
+        for (size_t i = 0; i < objects.size(); ++i)
+        {
+            double tnear = ray_t.min, tfar = ray_t.max;
+            size_t pi;
+            ++node_visits;
+            if (objects_bounds[i].hit(NdotOrig, NdotDir, tnear, tfar, pi) && objects[i]->occluded(r, ray_t))
+            {
+                record_traversal(node_visits);
+                return true;
+            }
+        }
+#else
+        //any hit ends the traversal, so visiting order does not matter
+        slab_ray sr(NdotOrig, NdotDir);
+        unsigned int stack[TRAVERSAL_STACK_SIZE];
+        int stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size)
+        {
+            const flat_node &node = nodes[stack[--stack_size]];
+            ++node_visits;
+            double tnear = ray_t.min, tfar = ray_t.max;
+            if (!node.hit(sr, tnear, tfar))
+                continue;
+            if (node.is_leaf)
+            {
+                for (unsigned int i = node.offset; i < node.offset + node.count; ++i)
+                {
+                    if (leaf_objects[i]->occluded(r, ray_t))
+                    {
+                        record_traversal(node_visits);
+                        return true;
+                    }
+                }
+                continue;
+            }
+            for (unsigned int i = node.offset; i < node.offset + node.count; ++i)
+                stack[stack_size++] = i;
+        }
+#endif
+        record_traversal(node_visits);
+        return false;
+    }
 };
 const vec3 BVH::plane_set_normals[BVH::num_plane_set_normals] = {
     vec3(1, 0, 0),
@@ -3,23 +3,20 @@
 
 #include "utilities.h"
 
+#include "acceleration.h"
 #include "colour.h"
+#include "film.h"
 #include "hittable.h"
+#include "image_writer.h"
 #include "material.h"
-#include <thread>
-#include <mutex>
-#include <queue>
+#include "material_table.h"
+#include "path_queue.h"
+#include "scheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 using namespace std;
 
-#define THREAD_COUNT 20
-
-static unsigned int NUM_TASK;
-
-static std::vector<colour> COLOUR_VEC;
-std::mutex task_mutex;
-std::queue<int> TASK_Q;
-std::vector<std::thread> PIXEL_THREADS(THREAD_COUNT);
-
 class camera
 {
 public:
@@ -39,76 +36,425 @@ public:
     // colour background_colour = colour(1.0, 1.0, 1.0);
     colour background_colour = colour(0.70, 0.80, 1.00);
     bool contains_external_light_source = false;
+    bool packet_tracing = true; // trace camera rays of PACKET_SIZE neighbouring pixels together
+    uint64_t seed = 0;          // every pixel seeds its own sampler from this, so images do not depend on thread count
+    int tile_size = 16;         // Side of the square image tiles handed to threads, best kept a multiple of PACKET_SIZE
+    unsigned int thread_count = 0; // Render threads, 0 uses one per hardware thread
+    std::string output_path;       // Image file, format chosen by extension (.ppm .pfm .hdr), empty writes P3 to cout
+    bool progressive = false;      // Render in passes of samples_per_pass, stopping at samples_per_pixel or time_budget
+    int samples_per_pass = 4;
+    double time_budget = 0;        // Seconds before no new tiles are started, 0 for no limit. The first pass always finishes
+    double snapshot_interval = 0;  // Seconds between progressive snapshots written to output_path, 0 for none
+    bool adaptive = false;         // Passes like progressive, but pixels stop once their error is below adaptive_threshold
+    double adaptive_threshold = 0.005; // Standard error of a pixel after the gamma transform
+    int adaptive_min_samples = 16; // Samples taken everywhere before the error estimate is trusted
+    film image;                    // Accumulated samples
+    // Emitters sampled directly at every diffuse hit (next event estimation), usually accel::lights()
+    // Must hold every emissive object of the world, left empty lights are only found by scattered rays
+    std::vector<shared_ptr<hittable>> lights;
+    int russian_roulette_depth = 3; // Bounces after which paths may be terminated at random, max_depth disables it
+    bool wavefront = false;        // Trace tiles stage by stage over a queue of paths instead of path by path
+    int wavefront_batch = 4096;    // Paths in flight per tile in wavefront mode
+    bool sort_by_material = true;  // Wavefront mode shades the hits of a round grouped by material
 
     /**
      * CAUTION: Multithreaded implementation!!!
-     * A Thread is assigned to each row and 
-     * no locks are used other than for accessing the task queue
+     * The image is split into tile_size x tile_size tiles that are rendered independently
+     * and balanced between threads by a work stealing scheduler.
+     * Every pixel is written by exactly one tile per pass, so no locks are held while rendering.
+     * In progressive mode samples are taken in passes of samples_per_pass over the whole image,
+     * accumulating in the film, until samples_per_pixel or the time budget is reached.
+     * The budget only cuts passes after a first one of 1 sample, so no pixel is left without samples.
+     * Adaptive mode renders the same passes but skips pixels that have converged,
+     * and tiles whose pixels all have, so later passes only cover the noisy regions.
+     * Convergence is decided between passes, so a tile whose neighbour turns noisy again is sampled again
     */
-    void render(const hittable &world)
+    void render(const accel &world)
     {
         initialize();
+        materials = &world.materials;
+
+        int tiles_x = (image_width + tile_size - 1) / tile_size;
+        int tiles_y = (image_height + tile_size - 1) / tile_size;
+        unsigned int num_tiles = tiles_x * tiles_y;
+        scheduler tile_scheduler(thread_count);
+        clog << "Rendering " << num_tiles << " tiles on " << tile_scheduler.threads() << " threads\n";
 
-        cout << "P3\n"
-             << image_width << ' ' << image_height << "\n255\n";
-        for (int j = 0; j < image_height; ++j)
+        auto start = std::chrono::steady_clock::now();
+        auto last_snapshot = start;
+        std::atomic<bool> out_of_time(false);
+        std::vector<char> tile_active(num_tiles);
+        int pass_samples = progressive || adaptive ? std::max(1, samples_per_pass) : samples_per_pixel;
+        int samples_done = 0;
+        for (int pass = 0; samples_done < samples_per_pixel && !out_of_time; ++pass)
         {
-            TASK_Q.push(j);
-            NUM_TASK++;
+            //the first pass is never cut short, so under a time budget it only takes 1 sample to get every pixel one quickly
+            int samples = std::min(pass == 0 && time_budget > 0 ? 1 : pass_samples, samples_per_pixel - samples_done);
+            if (pass > 0 && time_budget > 0 && seconds_since(start) > time_budget)
+            {
+                clog << "\rTime budget reached after pass " << pass << ", pixels have " << (adaptive ? "up to " : "") << samples_done << " samples\n";
+                break;
+            }
+            std::atomic<unsigned int> tiles_done(0);
+            std::atomic<unsigned int> pixels_sampled(0);
+            //which pixels and tiles this pass samples is fixed up front, a tile then never reads pixels other threads write
+            update_sample_mask(tile_scheduler);
+            for (unsigned int tile = 0; tile < num_tiles; ++tile)
+            {
+                int x0 = (tile % tiles_x) * tile_size, y0 = (tile / tiles_x) * tile_size;
+                tile_active[tile] = false;
+                for (int j = y0; j < std::min(y0 + tile_size, image_height) && !tile_active[tile]; ++j)
+                {
+                    for (int i = x0; i < std::min(x0 + tile_size, image_width) && !tile_active[tile]; ++i)
+                        tile_active[tile] = needs_samples(i, j);
+                }
+            }
+            tile_scheduler.run(num_tiles, [&](unsigned int tile, unsigned int worker)
+                               {
+                                   //tiles not started before the deadline keep the samples of earlier passes
+                                   if (pass > 0 && (out_of_time || (time_budget > 0 && seconds_since(start) > time_budget)))
+                                   {
+                                       out_of_time = true;
+                                       return;
+                                   }
+                                   if (tile_active[tile])
+                                   {
+                                       int x0 = (tile % tiles_x) * tile_size;
+                                       int y0 = (tile / tiles_x) * tile_size;
+                                       pixels_sampled += render_tile(x0, y0, std::min(x0 + tile_size, image_width),
+                                                                     std::min(y0 + tile_size, image_height), pass, samples, world);
+                                   }
+                                   unsigned int done = ++tiles_done;
+                                   if (worker == 0) //only one thread reports, so clog needs no lock
+                                       clog << "\rPass " << pass + 1 << ", tiles remaining: " << num_tiles - done << ' ' << flush; });
+            samples_done += samples;
+            if (pixels_sampled == 0 && !out_of_time)
+            {
+                clog << "\rAll pixels converged after " << samples_done - samples << " samples          \n";
+                break;
+            }
+            if (out_of_time)
+                clog << "\rTime budget reached in pass " << pass + 1 << ", pixels have "
+                     << samples_done - samples << " or " << samples_done << " samples\n";
+
+            if (snapshot_interval > 0 && !output_path.empty() && samples_done < samples_per_pixel && !out_of_time &&
+                seconds_since(last_snapshot) >= snapshot_interval)
+            {
+                write_image();
+                last_snapshot = std::chrono::steady_clock::now();
+                clog << "\rSnapshot written at " << samples_done << " spp          \n";
+            }
         }
-        for (int k = 0; k < THREAD_COUNT; ++k)
+        if (adaptive)
         {
-            clog << "thread number: " << k + 1 << " initialized \n";
-            PIXEL_THREADS[k] = std::thread(&camera::assign_thread_task, this, std::ref(world));
+            long long total_samples = 0;
+            for (int k = 0; k < image_width * image_height; ++k)
+                total_samples += image.samples(k);
+            clog << "\rAdaptive sampling: " << static_cast<double>(total_samples) / (image_width * image_height)
+                 << " samples per pixel on average\n";
         }
-        for (auto &th : PIXEL_THREADS)
+        clog << "\rDone.                 \n";
+        write_image();
+    }
+
+    /**
+     * Renders samples more samples of the pixels in [x0, x1) x [y0, y1)
+     * @return: number of pixels sampled, the others have converged
+    */
+    int render_tile(int x0, int y0, int x1, int y1, int pass, int samples, const hittable &world)
+    {
+        if (wavefront)
+            return render_tile_wavefront(x0, y0, x1, y1, pass, samples, world);
+        int sampled = 0;
+        for (int j = y0; j < y1; ++j)
         {
-            th.join();
+            if (packet_tracing)
+                sampled += colour_pixel_packets(j, x0, x1, pass, samples, world);
+            else
+                sampled += colour_pixel(j, x0, x1, pass, samples, world);
         }
+        return sampled;
+    }
 
-        for (colour pixel : COLOUR_VEC)
+    /**
+     * Adds samples samples to the pixels of [x0, x1) in row j that still need them
+     * @return: number of pixels sampled
+    */
+    int colour_pixel(int j, int x0, int x1, int pass, int samples, const hittable &world)
+    {
+        int sampled = 0;
+        for (int i = x0; i < x1; ++i)
         {
-            write_colour(std::cout, pixel, samples_per_pixel);
+            if (!needs_samples(i, j))
+                continue;
+            colour pixel_color(0, 0, 0);
+            running_stats pixel_stats;
+            sampler rng(sampler::pixel_seed(seed, i, j, pass));
+            for (int sample = 0; sample < samples; ++sample)
+            {
+                ray r = get_ray(i, j, rng);
+                colour sample_color = ray_colour(r, world, rng);
+                pixel_color += sample_color;
+                pixel_stats.add(luminance(sample_color));
+            }
+            image.add(i, j, pixel_color, pixel_stats);
+            ++sampled;
         }
-        clog << "\rDone.                 \n";
+        return sampled;
+    }
+
+    /**
+     * Same as colour_pixel, but the camera rays of PACKET_SIZE horizontally neighbouring pixels
+     * are traced together as one packet, bounces after the first hit are traced per ray
+    */
+    int colour_pixel_packets(int j, int x0, int x1, int pass, int samples, const hittable &world)
+    {
+        int sampled = 0;
+        for (int i = x0; i < x1; i += PACKET_SIZE)
+        {
+            colour pixel_colors[PACKET_SIZE];
+            running_stats pixel_stats[PACKET_SIZE];
+            sampler rngs[PACKET_SIZE];
+            ray_packet packet;
+            packet.active = 0;
+            for (int k = 0; k < PACKET_SIZE && i + k < x1; ++k)
+            {
+                if (!needs_samples(i + k, j))
+                    continue;
+                packet.active |= 1 << k;
+                rngs[k].set_seed(sampler::pixel_seed(seed, i + k, j, pass));
+            }
+            if (!packet.active)
+                continue;
+            for (int sample = 0; sample < samples; ++sample)
+            {
+                double t_max[PACKET_SIZE];
+                hit_record recs[PACKET_SIZE];
+                for (int k = 0; k < PACKET_SIZE; ++k)
+                {
+                    if ((packet.active >> k) & 1)
+                        packet.rays[k] = get_ray(i + k, j, rngs[k]);
+                    t_max[k] = infinity;
+                }
+                packet.set_up();
+                int hit_mask = world.hit_packet(packet, packet.active, t_max, recs);
+                for (int k = 0; k < PACKET_SIZE; ++k)
+                {
+                    if (!((packet.active >> k) & 1))
+                        continue;
+                    colour sample_color = (hit_mask >> k) & 1 ? shade(packet.rays[k], recs[k], world, rngs[k])
+                                                              : background_colour;
+                    pixel_colors[k] += sample_color;
+                    pixel_stats[k].add(luminance(sample_color));
+                }
+            }
+            for (int k = 0; k < PACKET_SIZE; ++k)
+            {
+                if ((packet.active >> k) & 1)
+                {
+                    image.add(i + k, j, pixel_colors[k], pixel_stats[k]);
+                    ++sampled;
+                }
+            }
+        }
+        return sampled;
     }
 
-    void assign_thread_task(const hittable &world)
+    /**
+     * Wavefront version of render_tile: up to wavefront_batch paths of the tile are in flight at once
+     * and every stage (generate, intersect, shade, shadow, extend) is one loop over all of them.
+     * Shading visits the hits ordered by material so the same scatter code runs back to back.
+     * Every sample has its own sampler, so images differ from the other modes by noise only
+     * @return: number of pixels sampled
+    */
+    int render_tile_wavefront(int x0, int y0, int x1, int y1, int pass, int samples, const hittable &world)
     {
+        int tile_width = x1 - x0;
+        std::vector<int> tile_pixels; // index in the tile of every pixel that needs samples
+        for (int j = y0; j < y1; ++j)
+        {
+            for (int i = x0; i < x1; ++i)
+            {
+                if (needs_samples(i, j))
+                    tile_pixels.push_back((j - y0) * tile_width + i - x0);
+            }
+        }
+        std::vector<colour> pixel_colors(tile_width * (y1 - y0), colour(0, 0, 0));
+        std::vector<running_stats> pixel_stats(tile_width * (y1 - y0));
+
+        path_queue paths;
+        paths.reserve(wavefront_batch);
+        shadow_queue shadows;
+        std::vector<int> shading_order, sorted_order;
+        std::vector<int> material_start;
+        size_t num_jobs = tile_pixels.size() * samples;
+        size_t next_job = 0;
         while (true)
         {
-            int pixel_column;
-            int curr_q_size;
+            // generate: refill the queue with camera rays, the samples of a pixel are consecutive
+            size_t first_new = paths.size();
+            for (; paths.size() < static_cast<size_t>(wavefront_batch) && next_job < num_jobs; ++next_job)
+            {
+                int p = tile_pixels[next_job / samples];
+                int i = x0 + p % tile_width, j = y0 + p / tile_width;
+                // the sample index goes to the high bits, pixel_seed only flips the low ones with the pass
+                sampler rng(sampler::pixel_seed(seed, i, j, pass) ^ (static_cast<uint64_t>(next_job % samples) << 40));
+                ray r = get_ray(i, j, rng);
+                paths.push(r, p, rng);
+            }
+            if (!paths.size())
+                break;
+
+            intersect_paths(paths, first_new, world);
+
+            // shade: misses end on the background, hits bounce grouped by material
+            shading_order.clear();
+            shadows.clear();
+            material_start.assign(materials->size() + 1, 0);
+            for (size_t i = 0; i < paths.size(); ++i)
+            {
+                if (paths.hit[i])
+                {
+                    shading_order.push_back(i);
+                    ++material_start[paths.recs[i].material_id + 1];
+                }
+                else
+                {
+                    paths.radiance[i] += paths.throughput[i] * background_colour;
+                    paths.alive[i] = false;
+                }
+            }
+            if (sort_by_material)
+            {
+                // counting sort on the material id, keeping queue order within a material
+                for (size_t m = 1; m < material_start.size(); ++m)
+                    material_start[m] += material_start[m - 1];
+                sorted_order.resize(shading_order.size());
+                for (int i : shading_order)
+                    sorted_order[material_start[paths.recs[i].material_id]++] = i;
+                shading_order.swap(sorted_order);
+            }
+            for (int i : shading_order)
             {
-                std::lock_guard<std::mutex> lock(task_mutex);
-                if (TASK_Q.empty())
+                shadow_ray shadow;
+                paths.alive[i] = bounce(paths.rays[i], paths.recs[i], paths.depth[i], paths.throughput[i],
+                                        paths.radiance[i], paths.bsdf_pdf[i], paths.rngs[i], shadow);
+                ++paths.depth[i];
+                if (shadow.distance > 0)
+                    shadows.push(shadow.r, shadow.distance, shadow.contribution, i);
+            }
+
+            // shadow: visibility of the light samples
+            for (size_t k = 0; k < shadows.size(); ++k)
+            {
+                if (!world.occluded(shadows.rays[k], interval(0.001, shadows.distance[k] - 0.001)))
+                    paths.radiance[shadows.path[k]] += shadows.contribution[k];
+            }
+
+            // extend: finished paths go to their pixel, the others stay queued for the next intersect
+            for (size_t i = 0; i < paths.size(); ++i)
+            {
+                if (!paths.alive[i])
                 {
-                    curr_q_size = 0;
-                    break; //exit because no more tasks available
+                    pixel_colors[paths.pixel[i]] += paths.radiance[i];
+                    pixel_stats[paths.pixel[i]].add(luminance(paths.radiance[i]));
                 }
-                pixel_column = TASK_Q.front();
-                TASK_Q.pop();
-                clog << "\rScanlines remaining: " << --NUM_TASK << ' ' << flush;
             }
-            this->colour_pixel(pixel_column, world);
+            paths.compact();
         }
+
+        for (int p : tile_pixels)
+            image.add(x0 + p % tile_width, y0 + p / tile_width, pixel_colors[p], pixel_stats[p]);
+        return tile_pixels.size();
     }
-    void colour_pixel(int pixel_column, const hittable &world)
+
+    /**
+     * Intersect stage of the wavefront integrator
+     * The camera rays generated this round, from first_new on, are coherent and traced as packets
+    */
+    void intersect_paths(path_queue &paths, size_t first_new, const hittable &world) const
     {
-        for (int i = 0; i < image_width; ++i)
+        for (size_t i = 0; i < first_new; ++i)
+            paths.hit[i] = world.hit(paths.rays[i], interval(0.001, infinity), paths.recs[i]);
+        for (size_t i = first_new; i < paths.size(); i += PACKET_SIZE)
         {
-            colour pixel_color(0, 0, 0);
-            for (int sample = 0; sample < samples_per_pixel; ++sample)
+            ray_packet packet;
+            double t_max[PACKET_SIZE];
+            hit_record recs[PACKET_SIZE];
+            packet.active = 0;
+            for (int k = 0; k < PACKET_SIZE && i + k < paths.size(); ++k)
+            {
+                packet.rays[k] = paths.rays[i + k];
+                packet.active |= 1 << k;
+            }
+            for (int k = 0; k < PACKET_SIZE; ++k)
+                t_max[k] = infinity;
+            packet.set_up();
+            int hit_mask = world.hit_packet(packet, packet.active, t_max, recs);
+            for (int k = 0; k < PACKET_SIZE && i + k < paths.size(); ++k)
             {
-                ray r = get_ray(i, pixel_column);
-                pixel_color += ray_colour(r, max_depth, world);
+                paths.hit[i + k] = (hit_mask >> k) & 1;
+                if (paths.hit[i + k])
+                    paths.recs[i + k] = recs[k];
             }
-            COLOUR_VEC[(pixel_column * image_width) + i] = pixel_color;
         }
-        return;
+    }
+
+    /**
+     * Writes the film to output_path, or to cout as P3 when no path is set
+    */
+    void write_image()
+    {
+        image_writer writer(thread_count);
+        image_format format;
+        if (output_path.empty())
+            writer.write(std::cout, image, P3_IMAGE);
+        else if (!image_format_from_path(output_path, format) || !writer.write(output_path, image, format))
+            cerr << "could not write image to " << output_path << endl;
     }
 
 private:
+    static double seconds_since(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    std::vector<char> sample_mask; // pixels sampled by the current pass
+    const material_table *materials = nullptr; // of the world being rendered, by the ids in its hit records
+
+    /**
+     * Adaptive sampling stops at a pixel once the error estimates of it and its 8 neighbours are below the threshold.
+     * Looking at the neighbours catches pixels where a rare bright path (a caustic) has not been found yet,
+     * which would otherwise look converged with zero variance.
+     * Evaluated on the film left by the previous pass, before any tile of the next one starts,
+     * since neighbours across a tile border are written by other threads during a pass
+    */
+    void update_sample_mask(scheduler &pool)
+    {
+        sample_mask.assign(image_width * image_height, true);
+        if (!adaptive)
+            return;
+        pool.parallel_for(image_height, [&](unsigned int j)
+                          {
+                              for (int i = 0; i < image_width; ++i)
+                              {
+                                  if (image.samples(j * image_width + i) < adaptive_min_samples)
+                                      continue;
+                                  bool noisy = false;
+                                  for (int y = std::max<int>(j - 1, 0); y <= std::min<int>(j + 1, image_height - 1) && !noisy; ++y)
+                                  {
+                                      for (int x = std::max(i - 1, 0); x <= std::min(i + 1, image_width - 1) && !noisy; ++x)
+                                          noisy = image.error(y * image_width + x) > adaptive_threshold;
+                                  }
+                                  sample_mask[j * image_width + i] = noisy;
+                              } });
+    }
+
+    bool needs_samples(int i, int j) const
+    {
+        return sample_mask.empty() || sample_mask[j * image_width + i]; // empty outside render()
+    }
+
     int image_height;     // Rendered image height
     point3 camera_center; // Camera center
     point3 pixel00_loc;   // Location of pixel 0, 0
@@ -122,8 +468,7 @@ private:
     {
         image_height = static_cast<int>(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
-        COLOUR_VEC.resize(image_height * image_width); //allocate vector for number of pixels
-        // PIXEL_THREADS.resize(image_height);
+        image.resize(image_width, image_height);
         camera_center = lookfrom;
 
         // Determine viewport dimensions.
@@ -154,52 +499,138 @@ private:
         defocus_disk_u = u * defocus_radius;
         defocus_disk_v = v * defocus_radius;
     }
-    colour ray_colour(const ray &r, int depth, const hittable &world)
+    colour ray_colour(const ray &r, const hittable &world, sampler &rng)
     {
         hit_record rec;
-        if (depth <= 0)
-            return colour(0, 0, 0);
-        bool world_hit = false;
+        if (world.hit(r, interval(0.001, infinity), rec))
+            return shade(r, rec, world, rng);
+        return background_colour;
+    }
+
+    /**
+     * Colour carried back along a path whose first ray r hit the world at rec
+     * Iterative: the path is extended one bounce at a time while throughput holds the product of attenuations
+    */
+    colour shade(ray r, hit_record rec, const hittable &world, sampler &rng)
+    {
+        colour radiance(0, 0, 0);
+        colour throughput(1, 1, 1);
+        double bsdf_pdf = 0;
+        for (int depth = 1;; ++depth)
+        {
+            shadow_ray shadow;
+            bool alive = bounce(r, rec, depth, throughput, radiance, bsdf_pdf, rng, shadow);
+            if (shadow.distance > 0 && !world.occluded(shadow.r, interval(0.001, shadow.distance - 0.001)))
+                radiance += shadow.contribution;
+            if (!alive)
+                break;
+            if (!world.hit(r, interval(0.001, infinity), rec))
+            {
+                radiance += throughput * background_colour;
+                break;
+            }
+        }
+        return radiance;
+    }
+
+    // light sample of next event estimation waiting for its visibility test, distance 0 if there is none
+    struct shadow_ray
+    {
+        ray r;
+        double distance = 0;
+        colour contribution; // radiance added to the path if unoccluded
+    };
+
+    /**
+     * One bounce of a path at its hit rec, shared by the per path and the wavefront integrator
+     * Adds the light emitted at rec to radiance and scatters r, updating throughput and bsdf_pdf
+     * (density the scattered ray was picked with, 0 for camera rays and specular bounces).
+     * After russian_roulette_depth bounces paths with little throughput are terminated at random and
+     * the survivors scaled up to stay unbiased.
+     * Diffuse hits sample a light directly (returned in shadow), and emitters hit by a scattered ray are weighted
+     * against that light sample with multiple importance sampling, so each light path is counted once
+     * @return: false if the path ends here
+    */
+    bool bounce(ray &r, const hit_record &rec, int depth, colour &throughput, colour &radiance, double &bsdf_pdf,
+                sampler &rng, shadow_ray &shadow) const
+    {
+        colour light_emitted = materials->emit_light(rec.material_id);
+        if (bsdf_pdf > 0 && !lights.empty() && light_emitted.length_squared() > 0)
+            light_emitted = light_emitted * power_heuristic(bsdf_pdf, rec.object->light_pdf(r.origin(), rec) / lights.size());
+        radiance += throughput * light_emitted;
+
+        ray scattered;
+        colour attenuation;
+        if (!materials->scatter(rec.material_id, r, rec, attenuation, scattered, rng))
+            return false;
+        bsdf_pdf = 0;
+        if (!materials->is_specular(rec.material_id) && !lights.empty())
         {
-            world_hit = world.hit(r, interval(0.001, infinity), rec);
+            if (connect_light(r, rec, rng, shadow))
+                shadow.contribution = throughput * shadow.contribution;
+            bsdf_pdf = materials->pdf(rec.material_id, r, rec, scattered.direction());
         }
-        if (world_hit)
+        if (depth >= max_depth)
+            return false;
+
+        throughput = throughput * attenuation;
+        if (depth >= russian_roulette_depth)
         {
-            ray scattered;
-            colour attenuation;
-            colour light_emitted = rec.mat->emit_light();
-            if (rec.mat->scatter(r, rec, attenuation, scattered))
-                return (attenuation * ray_colour(scattered, depth - 1, world)) + light_emitted;
-            return light_emitted;
+            double survival = fmin(1.0, fmax(throughput.x(), fmax(throughput.y(), throughput.z())));
+            if (random_double(rng) >= survival)
+                return false;
+            throughput /= survival;
         }
-        else
-            return background_colour;
+        r = scattered;
+        return true;
+    }
+
+    /**
+     * Next event estimation: picks a point on a random light and computes the light it sends to rec,
+     * weighted against picking the same direction by scattering. Visibility is left to the caller
+     * @return: false if nothing can arrive from the picked point
+    */
+    bool connect_light(const ray &r, const hit_record &rec, sampler &rng, shadow_ray &shadow) const
+    {
+        unsigned int i = std::min<unsigned int>(random_double(rng) * lights.size(), lights.size() - 1);
+        light_sample sample;
+        if (!lights[i]->sample_light(rec.p, rng, sample))
+            return false;
+        colour f = materials->eval(rec.material_id, r, rec, sample.direction);
+        if (f.length_squared() <= 0)
+            return false;
+        double light_pdf = sample.pdf / lights.size();
+        double weight = power_heuristic(light_pdf, materials->pdf(rec.material_id, r, rec, sample.direction));
+        shadow.r = ray(rec.p, sample.direction);
+        shadow.distance = sample.distance;
+        shadow.contribution = f * sample.emitted * (weight / light_pdf);
+        return true;
     }
 
-    ray get_ray(int i, int j) const
+    ray get_ray(int i, int j, sampler &rng) const
     {
         // Get a randomly sampled camera ray for the pixel at location i,j from camera defocus dist
 
         point3 pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
-        point3 pixel_sample = pixel_center + pixel_sample_square();
+        point3 pixel_sample = pixel_center + pixel_sample_square(rng);
 
-        point3 ray_origin = (defocus_angle <= 0) ? camera_center : defocus_disk_sample();
+        point3 ray_origin = (defocus_angle <= 0) ? camera_center : defocus_disk_sample(rng);
         point3 ray_direction = pixel_sample - ray_origin;
 
         return ray(ray_origin, ray_direction);
     }
-    vec3 pixel_sample_square() const
+    vec3 pixel_sample_square(sampler &rng) const
     {
         // Returns a random point in the square surrounding a pixel at the origin.
-        double px = -0.5 + random_double();
-        double py = -0.5 + random_double();
+        double px = -0.5 + random_double(rng);
+        double py = -0.5 + random_double(rng);
         return (px * pixel_delta_u) + (py * pixel_delta_v);
     }
 
-    point3 defocus_disk_sample() const
+    point3 defocus_disk_sample(sampler &rng) const
     {
         // Returns a random point in the camera defocus disk.
-        vec3 p = random_in_unit_disk();
+        vec3 p = random_in_unit_disk(rng);
         return camera_center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 };
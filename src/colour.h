@@ -10,28 +10,34 @@ inline double linear_to_gamma(double linear_component)
     return sqrt(linear_component);
 }
 
-void write_colour(std::ostream &out, colour pixel_color, int samples_per_pixel)
+// Rec. 709 relative luminance
+inline double luminance(const colour &c)
 {
-    double r = pixel_color.x();
-    double g = pixel_color.y();
-    double b = pixel_color.z();
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
 
-    // Divide the color by the number of samples.
-    double scale = 1.0 / samples_per_pixel;
-    r *= scale;
-    g *= scale;
-    b *= scale;
+// gamma transform of a linear colour
+inline colour tonemap(const colour &linear)
+{
+    return colour(linear_to_gamma(linear.x()), linear_to_gamma(linear.y()), linear_to_gamma(linear.z()));
+}
 
-    // Apply the linear to gamma transform.
-    r = linear_to_gamma(r);
-    g = linear_to_gamma(g);
-    b = linear_to_gamma(b);
+// translated [0,255] value of a tonemapped component
+inline int quantize(double component)
+{
+    static const interval intensity(0.000, 0.999);
+    return static_cast<int>(256 * intensity.clamp(component));
+}
+
+void write_colour(std::ostream &out, colour pixel_color, int samples_per_pixel)
+{
+    // Divide the color by the number of samples and apply the linear to gamma transform.
+    colour c = tonemap(pixel_color / samples_per_pixel);
 
     // Write the translated [0,255] value of each color component.
-    static const interval intensity(0.000, 0.999);
-    out << static_cast<int>(256 * intensity.clamp(r)) << ' '
-        << static_cast<int>(256 * intensity.clamp(g)) << ' '
-        << static_cast<int>(256 * intensity.clamp(b)) << '\n';
+    out << quantize(c.x()) << ' '
+        << quantize(c.y()) << ' '
+        << quantize(c.z()) << '\n';
 }
 
 #endif
\ No newline at end of file
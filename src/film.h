@@ -0,0 +1,91 @@
+#ifndef FILM_H
+#define FILM_H
+
+#include "colour.h"
+#include <cmath>
+#include <vector>
+
+/**
+ * Welford's running mean and variance, mergeable so that a batch of samples taken by one pass
+ * can be folded into a pixel at once
+*/
+struct running_stats
+{
+    int n = 0;
+    double mean = 0;
+    double m2 = 0; // sum of squared differences from the mean
+
+    void add(double x)
+    {
+        ++n;
+        double delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    void merge(const running_stats &other)
+    {
+        if (!other.n)
+            return;
+        int total = n + other.n;
+        double delta = other.mean - mean;
+        mean += delta * other.n / total;
+        m2 += other.m2 + delta * delta * (static_cast<double>(n) * other.n / total);
+        n = total;
+    }
+
+    double variance() const { return n > 1 ? m2 / (n - 1) : 0; }
+};
+
+/**
+ * Accumulation buffer of the image: per pixel sum of radiance samples and running statistics of their luminance.
+ * Sample counts are kept per pixel because progressive passes cut short by a deadline
+ * and adaptive sampling leave pixels with different numbers of samples
+*/
+class film
+{
+public:
+    int width = 0;
+    int height = 0;
+    std::vector<colour> sum;
+    std::vector<running_stats> stats;
+
+    void resize(int image_width, int image_height)
+    {
+        width = image_width;
+        height = image_height;
+        sum.assign(width * height, colour(0, 0, 0));
+        stats.assign(width * height, running_stats());
+    }
+
+    // only one thread may add to a pixel at a time
+    void add(int i, int j, const colour &sample_sum, const running_stats &sample_stats)
+    {
+        sum[j * width + i] += sample_sum;
+        stats[j * width + i].merge(sample_stats);
+    }
+
+    int samples(int k) const { return stats[k].n; }
+
+    // mean radiance of pixel k, black before its first sample
+    colour average(int k) const
+    {
+        return samples(k) ? sum[k] / samples(k) : colour(0, 0, 0);
+    }
+
+    /**
+     * Standard error of the mean luminance of pixel k after the gamma transform,
+     * so that the same error is about equally visible in dark and bright pixels
+    */
+    double error(int k) const
+    {
+        const running_stats &s = stats[k];
+        if (s.n < 2)
+            return infinity;
+        double standard_error = std::sqrt(s.variance() / s.n);
+        // d/dL sqrt(L) = 1 / (2 sqrt(L)), offset keeps black pixels with a rare bright sample from dividing by 0
+        return standard_error / (2 * std::sqrt(std::fmax(s.mean, 0.0)) + 1e-3);
+    }
+};
+
+#endif
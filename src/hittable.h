@@ -2,16 +2,26 @@
 #define HITTABLE_H
 
 #include "ray.h"
+#include "ray_packet.h"
 #include "utilities.h"
+#include "colour.h"
+#include <type_traits>
 
 class material;
+class material_table;
+class hittable;
 
+/**
+ * Hit records are copied on every closer hit, so they only hold plain values:
+ * the material is referenced by its id in the scene's material_table, which owns it
+*/
 class hit_record
 {
 public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
+    int material_id;
+    const hittable *object; // primitive that was hit, used to look up the density of hitting an emitter
     double t;
     bool front_face;
 
@@ -27,6 +37,19 @@ public:
     }
 };
 
+static_assert(std::is_trivially_copyable<hit_record>::value, "hit_record must stay trivially copyable");
+
+/**
+ * Point on an emitter picked for next event estimation
+*/
+struct light_sample
+{
+    vec3 direction;  // unit direction from the shading point to the sampled point
+    double distance; // to the sampled point
+    double pdf;      // solid angle density of direction
+    colour emitted;
+};
+
 class hittable
 {
 public:
@@ -34,6 +57,63 @@ public:
 
     virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
 
+    /**
+     * Any hit query for shadow/visibility rays: true as soon as some intersection
+     * within ray_t is found, without searching for the closest one or filling a hit_record
+    */
+    virtual bool occluded(const ray &r, interval ray_t) const
+    {
+        hit_record rec;
+        return hit(r, ray_t, rec);
+    }
+
+    /**
+     * Closest hit for each active lane of a packet, t_max holds each lane's closest hit so far
+     * The base version traces the lanes one by one, primitives and accelerators override it
+     * @return: mask of lanes for which a closer hit was found and written to recs
+    */
+    virtual int hit_packet(const ray_packet &packet, int active, double *t_max, hit_record *recs) const
+    {
+        int hit_mask = 0;
+        for (int i = 0; i < PACKET_SIZE; ++i)
+        {
+            if ((active >> i) & 1 && hit(packet.rays[i], interval(packet.t_min, t_max[i]), recs[i]))
+            {
+                t_max[i] = recs[i].t;
+                hit_mask |= 1 << i;
+            }
+        }
+        return hit_mask;
+    }
+
+    // gives the materials of the object their id in the scene's table, called when the object is added to an accel
+    virtual void register_materials(material_table &table) { (void)table; }
+
+    // objects with an emissive material are gathered into the light list
+    virtual bool is_emissive() const { return false; }
+
+    /**
+     * Picks a point on the surface as seen from origin, for direct light sampling
+     * @return: false if the object cannot be sampled from origin
+    */
+    virtual bool sample_light(const point3 &origin, sampler &rng, light_sample &sample) const
+    {
+        (void)origin;
+        (void)rng;
+        (void)sample;
+        return false;
+    }
+
+    /**
+     * Solid angle density with which sample_light from origin picks the point of rec
+    */
+    virtual double light_pdf(const point3 &origin, const hit_record &rec) const
+    {
+        (void)origin;
+        (void)rec;
+        return 0;
+    }
+
     virtual void compute_bounds(vec3 plane_set_normal, double &min_coord, double &max_coord)
     {
         (void) plane_set_normal;
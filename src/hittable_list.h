@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "interval.h"
+#include "material_table.h"
 
 #include <memory>
 #include <vector>
@@ -25,6 +26,12 @@ public:
         objects.push_back(object);
     }
 
+    void register_materials(material_table &table) override
+    {
+        for (const auto &object : objects)
+            object->register_materials(table);
+    }
+
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
         hit_record temp_rec;
@@ -43,6 +50,24 @@ public:
 
         return hit_anything;
     }
+
+    int hit_packet(const ray_packet &packet, int active, double *t_max, hit_record *recs) const override
+    {
+        int hit_mask = 0;
+        for (const auto &object : objects)
+            hit_mask |= object->hit_packet(packet, active, t_max, recs);
+        return hit_mask;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        for (const auto &object : objects)
+        {
+            if (object->occluded(r, ray_t))
+                return true;
+        }
+        return false;
+    }
 };
 
 #endif
\ No newline at end of file
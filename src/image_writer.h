@@ -0,0 +1,260 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include "colour.h"
+#include "film.h"
+#include "scheduler.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Output image formats
+ * P3: ASCII ppm, P6: binary ppm, PFM: linear float rgb, HDR: Radiance RGBE with run length encoded scanlines
+*/
+enum image_format
+{
+    P3_IMAGE,
+    P6_IMAGE,
+    PFM_IMAGE,
+    HDR_IMAGE
+};
+
+/**
+ * Picks the format from the file extension, .ppm is written as P6
+ * @return: false if the extension is not a known format
+*/
+inline bool image_format_from_path(const std::string &path, image_format &format)
+{
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos)
+        return false;
+    std::string extension = path.substr(dot + 1);
+    if (extension == "ppm")
+        format = P6_IMAGE;
+    else if (extension == "pfm")
+        format = PFM_IMAGE;
+    else if (extension == "hdr")
+        format = HDR_IMAGE;
+    else
+        return false;
+    return true;
+}
+
+/**
+ * Encodes the mean of every film pixel into a single in memory buffer, tonemapping and quantizing rows in parallel,
+ * so that the image is written with one call
+*/
+class image_writer
+{
+public:
+    image_writer(unsigned int num_threads = 0) : row_scheduler(num_threads) {}
+
+    std::string encode(const film &image, image_format format)
+    {
+        int width = image.width, height = image.height;
+        switch (format)
+        {
+        case P6_IMAGE:
+            return encode_fixed(image, "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n", 3,
+                                [&](int j, char *out)
+                                { p6_row(image, j, out); });
+        case PFM_IMAGE:
+            // negative scale marks little endian floats, rows are stored bottom to top
+            return encode_fixed(image, "PF\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n-1.0\n", 3 * sizeof(float),
+                                [&](int j, char *out)
+                                { pfm_row(image, height - 1 - j, out); });
+        case HDR_IMAGE:
+            return encode_variable(image, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " + std::to_string(height) + " +X " + std::to_string(width) + "\n",
+                                   [&](int j, std::string &out)
+                                   { hdr_row(image, j, out); });
+        case P3_IMAGE:
+        default:
+            return encode_variable(image, "P3\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n",
+                                   [&](int j, std::string &out)
+                                   { p3_row(image, j, out); });
+        }
+    }
+
+    /**
+     * @return: false if the file could not be written
+    */
+    bool write(const std::string &path, const film &image, image_format format)
+    {
+        std::string buffer = encode(image, format);
+        FILE *file = std::fopen(path.c_str(), "wb");
+        if (!file)
+            return false;
+        bool written = std::fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+        return std::fclose(file) == 0 && written;
+    }
+
+    void write(std::ostream &out, const film &image, image_format format)
+    {
+        std::string buffer = encode(image, format);
+        out.write(buffer.data(), buffer.size());
+        out.flush();
+    }
+
+private:
+    scheduler row_scheduler;
+
+    // formats where every row has the same encoded size are written in place
+    template <typename row_encoder>
+    std::string encode_fixed(const film &image, const std::string &header, size_t bytes_per_pixel, const row_encoder &encode_row)
+    {
+        int height = image.height;
+        size_t row_bytes = bytes_per_pixel * image.width;
+        std::string buffer(header.size() + row_bytes * height, '\0');
+        std::memcpy(&buffer[0], header.data(), header.size());
+        char *body = &buffer[header.size()];
+        row_scheduler.parallel_for(height, [&](unsigned int j)
+                                   { encode_row(j, body + row_bytes * j); });
+        return buffer;
+    }
+
+    // rows are encoded separately, then joined
+    template <typename row_encoder>
+    std::string encode_variable(const film &image, const std::string &header, const row_encoder &encode_row)
+    {
+        int height = image.height;
+        std::vector<std::string> rows(height);
+        row_scheduler.parallel_for(height, [&](unsigned int j)
+                                   { encode_row(j, rows[j]); });
+        size_t size = header.size();
+        for (const std::string &row : rows)
+            size += row.size();
+        std::string buffer;
+        buffer.reserve(size);
+        buffer += header;
+        for (const std::string &row : rows)
+            buffer += row;
+        return buffer;
+    }
+
+    static void p3_row(const film &image, int j, std::string &out)
+    {
+        char text[16];
+        for (int k = j * image.width; k < (j + 1) * image.width; ++k)
+        {
+            colour c = tonemap(image.average(k));
+            int length = std::snprintf(text, sizeof(text), "%d %d %d\n", quantize(c.x()), quantize(c.y()), quantize(c.z()));
+            out.append(text, length);
+        }
+    }
+
+    static void p6_row(const film &image, int j, char *out)
+    {
+        for (int k = j * image.width; k < (j + 1) * image.width; ++k)
+        {
+            colour c = tonemap(image.average(k));
+            for (int a = 0; a < 3; ++a)
+                *out++ = static_cast<char>(quantize(c[a]));
+        }
+    }
+
+    // PFM assumes a little endian host
+    static void pfm_row(const film &image, int j, char *out)
+    {
+        for (int k = j * image.width; k < (j + 1) * image.width; ++k)
+        {
+            colour c = image.average(k);
+            float rgb[3] = {float(c.x()), float(c.y()), float(c.z())};
+            std::memcpy(out, rgb, sizeof(rgb));
+            out += sizeof(rgb);
+        }
+    }
+
+    static void hdr_row(const film &image, int j, std::string &out)
+    {
+        int width = image.width;
+        std::vector<unsigned char> rgbe(4 * width);
+        for (int i = 0; i < width; ++i)
+            to_rgbe(image.average(j * width + i), &rgbe[4 * i]);
+
+        // run length encoding is only defined for these widths, otherwise pixels are stored flat
+        if (width < 8 || width > 0x7fff)
+        {
+            out.append(reinterpret_cast<const char *>(rgbe.data()), rgbe.size());
+            return;
+        }
+        out += char(2);
+        out += char(2);
+        out += char(width >> 8);
+        out += char(width & 0xff);
+        std::vector<unsigned char> channel(width);
+        for (int a = 0; a < 4; ++a)
+        {
+            for (int i = 0; i < width; ++i)
+                channel[i] = rgbe[4 * i + a];
+            rle_channel(channel, out);
+        }
+    }
+
+    // shared exponent encoding, 4 bytes per pixel
+    static void to_rgbe(const colour &c, unsigned char *rgbe)
+    {
+        double v = std::fmax(c.x(), std::fmax(c.y(), c.z()));
+        if (v < 1e-32)
+        {
+            rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+            return;
+        }
+        int exponent;
+        double mantissa = std::frexp(v, &exponent) * 256.0 / v;
+        rgbe[0] = static_cast<unsigned char>(c.x() * mantissa);
+        rgbe[1] = static_cast<unsigned char>(c.y() * mantissa);
+        rgbe[2] = static_cast<unsigned char>(c.z() * mantissa);
+        rgbe[3] = static_cast<unsigned char>(exponent + 128);
+    }
+
+    /**
+     * Radiance scanline encoding of one channel: a count byte above 128 repeats the next byte count - 128 times,
+     * otherwise count literal bytes follow. Runs shorter than 4 are cheaper stored as literals
+    */
+    static void rle_channel(const std::vector<unsigned char> &data, std::string &out)
+    {
+        const int min_run = 4;
+        int n = data.size();
+        int current = 0;
+        while (current < n)
+        {
+            // find the next run of at least min_run equal bytes
+            int run_start = current;
+            int run_count = 0;
+            int previous_run_count = 0;
+            while (run_count < min_run && run_start < n)
+            {
+                run_start += run_count;
+                previous_run_count = run_count;
+                run_count = 1;
+                while (run_start + run_count < n && run_count < 127 && data[run_start] == data[run_start + run_count])
+                    ++run_count;
+            }
+            // a short run directly before the long one is still worth encoding as a run
+            if (previous_run_count > 1 && previous_run_count == run_start - current)
+            {
+                out += char(128 + previous_run_count);
+                out += char(data[current]);
+                current = run_start;
+            }
+            while (current < run_start)
+            {
+                int literal_count = std::min(128, run_start - current);
+                out += char(literal_count);
+                out.append(reinterpret_cast<const char *>(&data[current]), literal_count);
+                current += literal_count;
+            }
+            if (run_count >= min_run)
+            {
+                out += char(128 + run_count);
+                out += char(data[run_start]);
+                current += run_count;
+            }
+        }
+    }
+};
+
+#endif
@@ -1,3 +1,4 @@
+#include "accel_factory.h"
 #include "bvh.h"
 #include "camera.h"
 #include "colour.h"
@@ -11,6 +12,7 @@
 #include "utilities.h"
 #include <chrono>
 #include "mesh.h"
+#include "mesh_cache.h"
 using namespace std::chrono;
 using namespace std;
 
@@ -18,11 +20,57 @@ using namespace std;
 /**
  * Responsible for constructing world of hittable objects
  * Then call render
+ * Usage: output_image [--accel octree|sah] [--threads N] [-o image.ppm|image.pfm|image.hdr]
+ *                     [--progressive] [--time SECONDS] [--snapshot SECONDS] [--adaptive THRESHOLD] [--wavefront]
+ * --time and --snapshot imply --progressive, snapshots need -o. --time may run over by the first pass, 1 sample per pixel
 */
-int main()
+int main(int argc, char **argv)
 {
+    accel_type world_accel = OCTREE_ACCEL;
+    int num_threads = 0;
+    string output_path;
+    image_format output_format;
+    bool progressive = false;
+    double time_budget = 0;
+    double snapshot_interval = 0;
+    double adaptive_threshold = 0;
+    bool wavefront = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--accel" && i + 1 < argc && parse_accel_type(argv[i + 1], world_accel))
+            ++i;
+        else if (arg == "--threads" && i + 1 < argc && (num_threads = atoi(argv[i + 1])) >= 0)
+            ++i;
+        else if (arg == "-o" && i + 1 < argc && image_format_from_path(argv[i + 1], output_format))
+            output_path = argv[++i];
+        else if (arg == "--progressive")
+            progressive = true;
+        else if (arg == "--time" && i + 1 < argc && (time_budget = atof(argv[i + 1])) > 0)
+        {
+            progressive = true;
+            ++i;
+        }
+        else if (arg == "--snapshot" && i + 1 < argc && (snapshot_interval = atof(argv[i + 1])) > 0)
+        {
+            progressive = true;
+            ++i;
+        }
+        else if (arg == "--adaptive" && i + 1 < argc && (adaptive_threshold = atof(argv[i + 1])) > 0)
+            ++i;
+        else if (arg == "--wavefront")
+            wavefront = true;
+        else
+        {
+            cerr << "usage: " << argv[0] << " [--accel octree|sah] [--threads N] [-o image.ppm|image.pfm|image.hdr]"
+                 << " [--progressive] [--time SECONDS] [--snapshot SECONDS] [--adaptive THRESHOLD] [--wavefront]" << endl;
+            return 1;
+        }
+    }
+
     // hittable_list world;
-    BVH world;
+    shared_ptr<accel> world_ptr = make_accel(world_accel);
+    accel &world = *world_ptr;
 
     // auto material_ground = make_shared<dielectric>(colour(1, 1, 1));
     auto material_ground = make_shared<dielectric>(1.52);
@@ -74,6 +122,18 @@ int main()
     // cam.image_width = 2000;
     cam.samples_per_pixel = 100;
     cam.max_depth = 50;
+    cam.thread_count = num_threads;
+    world.build_threads = num_threads;
+    cam.output_path = output_path;
+    cam.progressive = progressive;
+    cam.time_budget = time_budget;
+    cam.snapshot_interval = snapshot_interval;
+    cam.wavefront = wavefront;
+    if (adaptive_threshold > 0)
+    {
+        cam.adaptive = true;
+        cam.adaptive_threshold = adaptive_threshold;
+    }
 
     cam.vfov = 50;
     // cam.lookfrom = point3(-10, 65, 300);
@@ -86,25 +146,28 @@ int main()
     auto mag_colour = make_shared<lambertian>(colour(0.77734, 0.265625, 0.33984));
     // // world.add(make_shared<sphere>(point3(200, 120, 50.0), 150.5, material_light));
     auto start_parse = high_resolution_clock::now();
-    Parser obj_parser;
-    obj_parser.parse_obj("../obj_files/example.obj");
-    world.add(std::make_shared<mesh>(obj_parser.num_faces, obj_parser.face_index, obj_parser.vertex_index, obj_parser.vertices, mag_colour));
+    // parsed and built once, later runs read the mesh back from ../obj_files/tea.obj.cache
+    shared_ptr<mesh> teapot = mesh_cache::load_obj("../obj_files/tea.obj", mag_colour, num_threads);
+    if (!teapot)
+        return 1;
+    world.add(teapot);
 
 
     // Parser obj_parser_2;
     // obj_parser_2.parse_obj("../obj_files/mag.obj");
     // world.add(std::make_shared<mesh>(obj_parser_2.num_faces, obj_parser_2.face_index, obj_parser_2.vertex_index, obj_parser_2.vertices, mag_colour));
 
-    Parser obj_parser_3;
-    obj_parser_3.parse_obj("../obj_files/cube3.obj");
-    world.add(std::make_shared<mesh>(obj_parser_3.num_faces, obj_parser_3.face_index, obj_parser_3.vertex_index, obj_parser_3.vertices, mag_colour));
+    // Parser obj_parser_3;
+    // obj_parser_3.parse_obj("../obj_files/cube3.obj");
+    // world.add(std::make_shared<mesh>(obj_parser_3.num_faces, obj_parser_3.face_index, obj_parser_3.vertex_index, obj_parser_3.vertices, mag_colour));
 
     auto stop_parse = high_resolution_clock::now();
-    auto duration_parse = duration_cast<seconds>(stop_parse - start_parse);
-    clog << "DURATION OF PARSING " << duration_parse.count() << endl;
+    auto duration_parse = duration_cast<milliseconds>(stop_parse - start_parse);
+    clog << "DURATION OF MESH LOADING " << duration_parse.count() << " ms" << endl;
 
     //IMPORTANT LINE IF world is a BVH
-    world.compute_object_bounds();
+    world.set_up_bvh();
+    cam.lights = world.lights();
     auto start_render = high_resolution_clock::now();
     cam.render(world);
     auto stop_render = high_resolution_clock::now();
@@ -112,6 +175,7 @@ int main()
     auto duration_render = duration_cast<seconds>(stop_render - start_render);
 
     clog << "Duration of Render: " << duration_render.count() << endl;;
+    world.print_stats(clog);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+
+/**
+ * Read only memory mapping of a whole file, unmapped when destroyed or when another file is opened
+*/
+class mapped_file
+{
+public:
+    mapped_file() {}
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+    ~mapped_file() { close(); }
+
+    /**
+     * Maps the file at path, an empty file maps to size 0 and a null data pointer
+     * @return: false if the file cannot be opened or mapped
+    */
+    bool open(const std::string &path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0)
+        {
+            void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = mapping != MAP_FAILED;
+            if (ok)
+            {
+                bytes = static_cast<const char *>(mapping);
+                length = st.st_size;
+            }
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    void close()
+    {
+        if (bytes)
+            munmap(const_cast<char *>(bytes), length);
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const char *data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char *bytes = nullptr;
+    size_t length = 0;
+};
+
+#endif
@@ -7,9 +7,25 @@
 
 class hit_record;
 
+/**
+ * Concrete class of a material, so that material_table can call it directly instead of through the vtable
+ * Materials defined elsewhere are CUSTOM_MATERIAL and dispatched virtually
+*/
+enum material_type
+{
+    LAMBERTIAN_MATERIAL,
+    METAL_MATERIAL,
+    DIELECTRIC_MATERIAL,
+    LIGHT_MATERIAL,
+    CUSTOM_MATERIAL
+};
+
 class material
 {
 public:
+    const material_type type;
+
+    material(material_type t = CUSTOM_MATERIAL) : type(t) {}
     virtual ~material() = default;
 
     virtual colour emit_light() const
@@ -18,22 +34,49 @@ public:
     }
 
     virtual bool scatter(
-        const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered) const = 0;
+        const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered, sampler &rng) const = 0;
+
+    /**
+     * Materials that scatter into a single direction (or a small lobe around it) can not be lit by
+     * directions sampled from lights, they skip next event estimation and eval/pdf are not used
+    */
+    virtual bool is_specular() const
+    {
+        return true;
+    }
+
+    // BSDF times cosine for light arriving from direction
+    virtual colour eval(const ray &r_in, const hit_record &rec, const vec3 &direction) const
+    {
+        (void)r_in;
+        (void)rec;
+        (void)direction;
+        return colour(0, 0, 0);
+    }
+
+    // solid angle density with which scatter picks direction
+    virtual double pdf(const ray &r_in, const hit_record &rec, const vec3 &direction) const
+    {
+        (void)r_in;
+        (void)rec;
+        (void)direction;
+        return 0;
+    }
 };
 
-class lambertian : public material
+class lambertian final : public material
 {
 private:
     colour albedo;
 
 public:
-    lambertian(const colour &a) : albedo(a) {}
+    lambertian(const colour &a) : material(LAMBERTIAN_MATERIAL), albedo(a) {}
 
-    bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered)
+    bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered, sampler &rng)
         const override
     {
         (void)r_in;
-        vec3 scatter_direction = rec.normal + random_unit_vector();
+        vec3 scatter_direction = rec.normal + random_unit_vector(rng);
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
             scatter_direction = rec.normal;
@@ -41,28 +84,47 @@ public:
         attenuation = albedo;
         return true;
     }
+
+    bool is_specular() const override
+    {
+        return false;
+    }
+
+    // albedo / pi * cosine, which is albedo times the cosine weighted pdf
+    colour eval(const ray &r_in, const hit_record &rec, const vec3 &direction) const override
+    {
+        return albedo * pdf(r_in, rec, direction);
+    }
+
+    // scatter picks cosine weighted directions
+    double pdf(const ray &r_in, const hit_record &rec, const vec3 &direction) const override
+    {
+        (void)r_in;
+        double cosine = dot(rec.normal, unit_vector(direction));
+        return cosine > 0 ? cosine / pi : 0;
+    }
 };
 
-class metal : public material
+class metal final : public material
 {
 private:
     colour albedo;
     double fuzz;
 
 public:
-    metal(const colour &a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+    metal(const colour &a, double f) : material(METAL_MATERIAL), albedo(a), fuzz(f < 1 ? f : 1) {}
 
-    bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered)
+    bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered, sampler &rng)
         const override
     {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_unit_vector());
+        scattered = ray(rec.p, reflected + fuzz * random_unit_vector(rng));
         attenuation = albedo;
         return true;
     }
 };
 
-class dielectric : public material
+class dielectric final : public material
 {
 private:
     double ir; // Index of Refraction
@@ -76,9 +138,9 @@ private:
     }
 
 public:
-    dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+    dielectric(double index_of_refraction) : material(DIELECTRIC_MATERIAL), ir(index_of_refraction) {}
 
-    bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered)
+    bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered, sampler &rng)
         const override
     {
         attenuation = colour(1.0, 1.0, 1.0);
@@ -90,7 +152,7 @@ public:
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double(rng))
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -100,18 +162,19 @@ public:
     }
 };
 
-class light : public material
+class light final : public material
 {
 public:
-    light(colour c) : light_colour(c) {}
+    light(colour c) : material(LIGHT_MATERIAL), light_colour(c) {}
 
-    bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered)
+    bool scatter(const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered, sampler &rng)
         const override
     {
         (void)r_in;
         (void)rec;
         (void)attenuation;
         (void)scattered;
+        (void)rng;
         return false;
     }
 
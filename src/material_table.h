@@ -0,0 +1,119 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include "material.h"
+#include <cassert>
+#include <vector>
+
+/**
+ * Materials of a scene by integer id, hit records carry the id of the material that was hit.
+ * Calls go through a switch on the material type to the final classes of material.h,
+ * so the shading loop has direct, inlinable calls instead of one indirect call per bounce
+*/
+class material_table
+{
+public:
+    /**
+     * @return: id of m, materials shared by several objects are stored once
+    */
+    int add(const shared_ptr<material> &m)
+    {
+        for (size_t id = 0; id < entries.size(); ++id)
+        {
+            if (entries[id].mat == m.get())
+                return id;
+        }
+        owned.push_back(m);
+        entries.push_back(entry{m->type, m.get()});
+        return entries.size() - 1;
+    }
+
+    size_t size() const { return entries.size(); }
+
+    const material &operator[](int id) const { return *at(id).mat; }
+
+    colour emit_light(int id) const
+    {
+        const entry &e = at(id);
+        switch (e.type)
+        {
+        case LAMBERTIAN_MATERIAL:
+        case METAL_MATERIAL:
+        case DIELECTRIC_MATERIAL:
+            return colour(0, 0, 0);
+        case LIGHT_MATERIAL:
+            return static_cast<const light *>(e.mat)->emit_light();
+        default:
+            return e.mat->emit_light();
+        }
+    }
+
+    bool scatter(int id, const ray &r_in, const hit_record &rec, colour &attenuation, ray &scattered, sampler &rng) const
+    {
+        const entry &e = at(id);
+        switch (e.type)
+        {
+        case LAMBERTIAN_MATERIAL:
+            return static_cast<const lambertian *>(e.mat)->scatter(r_in, rec, attenuation, scattered, rng);
+        case METAL_MATERIAL:
+            return static_cast<const metal *>(e.mat)->scatter(r_in, rec, attenuation, scattered, rng);
+        case DIELECTRIC_MATERIAL:
+            return static_cast<const dielectric *>(e.mat)->scatter(r_in, rec, attenuation, scattered, rng);
+        case LIGHT_MATERIAL:
+            return false;
+        default:
+            return e.mat->scatter(r_in, rec, attenuation, scattered, rng);
+        }
+    }
+
+    bool is_specular(int id) const
+    {
+        const entry &e = at(id);
+        switch (e.type)
+        {
+        case LAMBERTIAN_MATERIAL:
+            return false;
+        case METAL_MATERIAL:
+        case DIELECTRIC_MATERIAL:
+        case LIGHT_MATERIAL:
+            return true;
+        default:
+            return e.mat->is_specular();
+        }
+    }
+
+    // eval and pdf are only used for non specular materials
+    colour eval(int id, const ray &r_in, const hit_record &rec, const vec3 &direction) const
+    {
+        const entry &e = at(id);
+        if (e.type == LAMBERTIAN_MATERIAL)
+            return static_cast<const lambertian *>(e.mat)->eval(r_in, rec, direction);
+        return e.mat->eval(r_in, rec, direction);
+    }
+
+    double pdf(int id, const ray &r_in, const hit_record &rec, const vec3 &direction) const
+    {
+        const entry &e = at(id);
+        if (e.type == LAMBERTIAN_MATERIAL)
+            return static_cast<const lambertian *>(e.mat)->pdf(r_in, rec, direction);
+        return e.mat->pdf(r_in, rec, direction);
+    }
+
+private:
+    struct entry
+    {
+        material_type type;
+        const material *mat;
+    };
+    std::vector<entry> entries;
+    std::vector<shared_ptr<material>> owned; // keeps the materials alive as long as the table
+
+    // an object that was never added to an accel still has material id -1
+    const entry &at(int id) const
+    {
+        assert(id >= 0 && static_cast<size_t>(id) < entries.size());
+        return entries[id];
+    }
+};
+
+#endif
@@ -1,72 +1,241 @@
 #ifndef MESH_H
 #define MESH_H
 #include "hittable.h"
+#include "mesh_source.h"
+#include "sah_bvh.h"
 #include "vec3.h"
 #include "material.h"
+#include "material_table.h"
 #include "triangle.h"
+#include "triangle_store.h"
+#include <algorithm>
 using std::unique_ptr;
 
+#define MESH_NO_NORMAL 0xffffffffu
+
 class mesh : public hittable
 {
+    friend class mesh_cache;
+
 private:
     unsigned int num_triangles;
     shared_ptr<material> mat;
-    unique_ptr<vec3[]> triangle_vertices;
-    std::vector<shared_ptr<triangle>> triangles;
-    unsigned int max_vertex_index;
+    int material_id = -1;
+    std::vector<vec3> triangle_vertices;
+    triangle_store triangles;   // stored in blas leaf order, so leaves are contiguous ranges
+    std::vector<sah_node> blas; // bottom level acceleration structure, built once over the triangles
+    std::vector<double> area_cdf; // running sum of triangle areas, only built for emissive meshes
 
-public:
-    mesh(const unsigned int num_faces, const std::unique_ptr<unsigned int[]> &face_index,
-         const std::unique_ptr<unsigned int[]> &vertex_index,
-         const std::unique_ptr<vec3[]> &vertices,
-         shared_ptr<material> material) : num_triangles(0), mat(material)
+    // smooth shading: unit normals shared between triangles, and the index of the normal of each triangle corner
+    // (3 per triangle, in blas leaf order, MESH_NO_NORMAL for a triangle without normals). Both empty for a flat mesh
+    std::vector<vec3> vertex_normals;
+    std::vector<unsigned int> corner_normals;
+    bool smooth = false;
+
+    void fill_record(const ray &r, double t, unsigned int triangle_index, double b1, double b2, hit_record &rec) const
     {
-        unsigned int k = 0;
-        for (unsigned int i = 0; i < num_faces; ++i)
+        rec.t = t;
+        // on the triangle rather than r.at(t): float lanes leave that up to ~1e-5 off the surface,
+        // enough for bounce rays to start on the wrong side of it
+        rec.p = triangles.point(triangle_index, b1, b2);
+        rec.material_id = material_id;
+        rec.object = this;
+        rec.set_face_normal(r, triangles.face_normal(triangle_index));
+        if (smooth)
+        {
+            vec3 n = shading_normal(triangle_index, b1, b2);
+            rec.normal = rec.front_face ? n : -n;
+        }
+    }
+
+    /**
+     * Normal of the corners interpolated with the barycentrics of the hit, the weights b1, b2 of the second
+     * and third corner returned by the watertight test, on the side of the face normal
+    */
+    vec3 shading_normal(unsigned int i, double b1, double b2) const
+    {
+        vec3 face = triangles.face_normal(i);
+        const unsigned int *corner = &corner_normals[3 * i];
+        if (corner[0] == MESH_NO_NORMAL)
+            return face;
+        vec3 n = (1 - b1 - b2) * vertex_normals[corner[0]] + b1 * vertex_normals[corner[1]] + b2 * vertex_normals[corner[2]];
+        if (n.near_zero())
+            return face;
+        n = unit_vector(n);
+        return dot(n, face) < 0 ? -n : n;
+    }
+
+    /**
+     * Set up that depends on the material, shared by the constructor and mesh_cache.
+     * Emitters stay flat shaded: light_pdf needs the geometric normal in the hit record
+    */
+    void set_up_material_data()
+    {
+        smooth = !corner_normals.empty() && !is_emissive();
+        if (!is_emissive())
+            return;
+        area_cdf.resize(num_triangles);
+        double total_area = 0;
+        for (unsigned int i = 0; i < num_triangles; ++i)
         {
-            num_triangles += face_index[i] - 2;
-            for (unsigned int j = 0; j < face_index[i]; ++j)
+            total_area += 0.5 * cross(triangles.edge(1, i), triangles.edge(2, i)).length();
+            area_cdf[i] = total_area;
+        }
+    }
+
+    // empty mesh for mesh_cache to fill in
+    explicit mesh(shared_ptr<material> material) : num_triangles(0), mat(material) {}
+
+    /**
+     * Drops the triangles of source with a corner index past its positions, such as OBJ_NO_INDEX for a missing one,
+     * and the corner normal indices if they are not given for every triangle
+     * @return: number of triangles left
+    */
+    static unsigned int keep_valid_triangles(mesh_source &source)
+    {
+        size_t num_positions = source.positions.size(), kept = 0;
+        if (source.triangle_normals.size() != source.triangles.size())
+            std::vector<unsigned int>().swap(source.triangle_normals);
+        bool has_normals = !source.triangle_normals.empty();
+        for (size_t i = 0; i < source.triangles.size() / 3; ++i)
+        {
+            const unsigned int *corner = &source.triangles[3 * i];
+            if (corner[0] >= num_positions || corner[1] >= num_positions || corner[2] >= num_positions)
+                continue;
+            for (size_t c = 0; c < 3; ++c)
             {
-                if (vertex_index[k + j] > max_vertex_index)
-                    max_vertex_index = vertex_index[k + j];
+                source.triangles[3 * kept + c] = source.triangles[3 * i + c];
+                if (has_normals)
+                    source.triangle_normals[3 * kept + c] = source.triangle_normals[3 * i + c];
             }
-            k += face_index[i];
+            ++kept;
         }
-        max_vertex_index += 1;
-
-        triangle_vertices = unique_ptr<vec3[]>(new vec3[max_vertex_index]);
-        for (unsigned int i = 0; i < max_vertex_index; ++i)
-            triangle_vertices[i] = vertices[i];
+        source.triangles.resize(3 * kept);
+        if (has_normals)
+            source.triangle_normals.resize(3 * kept);
+        return kept;
+    }
 
-        unique_ptr<unsigned int[]> triangle_vertex_index = unique_ptr<unsigned int[]>(new unsigned int[num_triangles * 3]);
-        unsigned int curr_index = 0;
+    /**
+     * Fans the faces into triangles, keeping the vertices up to the highest one referenced.
+     * A missing index (OBJ_NO_INDEX) wraps to 0 in the + 1 below, so it is left out and the mesh drops its triangles
+    */
+    static mesh_source triangulate(const unsigned int num_faces, const std::unique_ptr<unsigned int[]> &face_index,
+                                   const std::unique_ptr<unsigned int[]> &vertex_index,
+                                   const std::unique_ptr<vec3[]> &vertices,
+                                   const unsigned int *normal_index, const vec3 *normals, unsigned int num_normals)
+    {
+        mesh_source source;
+        unsigned int num_corners = 0, num_vertices = 0;
+        for (unsigned int i = 0; i < num_faces; ++i)
+            num_corners += face_index[i];
+        for (unsigned int k = 0; k < num_corners; ++k)
+            num_vertices = std::max(num_vertices, vertex_index[k] + 1);
+        source.positions.assign(vertices.get(), vertices.get() + num_vertices);
+        if (normals)
+            source.normals.assign(normals, normals + num_normals);
+        source.triangles.reserve(3 * (num_corners - 2 * num_faces));
+        if (normal_index)
+            source.triangle_normals.reserve(3 * (num_corners - 2 * num_faces));
         for (unsigned int i = 0, k = 0; i < num_faces; ++i)
         {
             for (unsigned int j = 0; j < face_index[i] - 2; ++j)
             {
-                triangle_vertex_index[curr_index] = vertex_index[k];
-                triangle_vertex_index[curr_index + 1] = vertex_index[k + j + 1];
-                triangle_vertex_index[curr_index + 2] = vertex_index[k + j + 2];
-                curr_index += 3;
+                unsigned int corners[3] = {k, k + j + 1, k + j + 2};
+                for (unsigned int c = 0; c < 3; ++c)
+                {
+                    source.triangles.push_back(vertex_index[corners[c]]);
+                    if (normal_index)
+                        source.triangle_normals.push_back(normal_index[corners[c]]);
+                }
             }
             k += face_index[i];
         }
-        //now store as triangle objects
+        return source;
+    }
 
-        for (unsigned int i = 0, j = 0; i < num_triangles; ++i, j += 3)
+public:
+    /**
+     * Optional vertex normals for smooth shading: normal_index holds the normal of each face corner like vertex_index,
+     * with indices past num_normals for corners without one. Without normal_index the normals are taken
+     * per vertex if there is one for every vertex. Triangles missing a corner normal are flat shaded
+    */
+    mesh(const unsigned int num_faces, const std::unique_ptr<unsigned int[]> &face_index,
+         const std::unique_ptr<unsigned int[]> &vertex_index,
+         const std::unique_ptr<vec3[]> &vertices,
+         shared_ptr<material> material,
+         const unsigned int *normal_index = nullptr, const vec3 *normals = nullptr,
+         unsigned int num_normals = 0)
+        : mesh(triangulate(num_faces, face_index, vertex_index, vertices, normal_index, normals, num_normals), material) {}
+
+    /**
+     * Builds the mesh from triangulated geometry, taking over its positions and normals without a copy.
+     * The indices are only needed until the triangles are in the store, so they are released after that.
+     * Triangles with a corner past the positions are dropped, see keep_valid_triangles.
+     * The blas is built on num_threads threads (0 for one per hardware thread)
+    */
+    mesh(mesh_source &&source, shared_ptr<material> material, unsigned int num_threads = 0)
+        : num_triangles(keep_valid_triangles(source)), mat(material)
+    {
+        triangle_vertices.swap(source.positions);
+        vertex_normals.swap(source.normals);
+        const std::vector<unsigned int> &triangle_vertex_index = source.triangles;
+        std::vector<unsigned int> &triangle_normal_index = source.triangle_normals;
+        if (triangle_normal_index.empty() && !vertex_normals.empty() && vertex_normals.size() >= triangle_vertices.size())
+            triangle_normal_index = triangle_vertex_index;
+        bool has_normals = !vertex_normals.empty() && !triangle_normal_index.empty();
+        for (unsigned int i = 0; has_normals && i < num_triangles; ++i)
+        {
+            unsigned int *corner = &triangle_normal_index[3 * i];
+            if (corner[0] >= vertex_normals.size() || corner[1] >= vertex_normals.size() || corner[2] >= vertex_normals.size())
+                corner[0] = corner[1] = corner[2] = MESH_NO_NORMAL;
+        }
+
+        //build the blas over the triangle bounds, then store the triangles in its leaf order
+        sah_builder builder;
+        {
+            std::vector<aabb> triangle_bounds(num_triangles);
+            scheduler pool(num_threads);
+            pool.parallel_blocks(num_triangles, pool.blocks(num_triangles, SAH_BLOCK_SIZE), [&](size_t begin, size_t end, unsigned int)
+                                 {
+                                     for (size_t i = begin; i < end; ++i)
+                                     {
+                                         for (unsigned int j = 0; j < 3; ++j)
+                                             triangle_bounds[i].extend(triangle_vertices[triangle_vertex_index[3 * i + j]]);
+                                     } });
+            builder.build(triangle_bounds, num_threads);
+        }
+        blas.swap(builder.nodes);
+        triangles.reserve(num_triangles);
+        if (has_normals)
+            corner_normals.reserve(3 * num_triangles);
+        for (unsigned int i = 0; i < num_triangles; ++i)
+        {
+            unsigned int j = 3 * builder.prim_indices[i];
+            triangles.add(triangle_vertices[triangle_vertex_index[j]],
+                          triangle_vertices[triangle_vertex_index[j + 1]],
+                          triangle_vertices[triangle_vertex_index[j + 2]]);
+            if (has_normals)
+                corner_normals.insert(corner_normals.end(), &triangle_normal_index[j], &triangle_normal_index[j] + 3);
+        }
+        triangles.finalize();
+        source = mesh_source();
+        if (has_normals)
         {
-            triangles.push_back(std::make_shared<triangle>(triangle_vertices[triangle_vertex_index[j]],
-                                                           triangle_vertices[triangle_vertex_index[j + 1]],
-                                                           triangle_vertices[triangle_vertex_index[j + 2]], mat));
+            for (vec3 &n : vertex_normals)
+                n = n.near_zero() ? vec3() : unit_vector(n);
         }
+        else
+            std::vector<vec3>().swap(vertex_normals);
+        set_up_material_data();
     }
 
     void compute_bounds(vec3 normal, double &dnear, double &dfar) override
     {
         double vec_dot;
-        for (size_t i = 0; i < max_vertex_index; ++i)
+        for (const vec3 &vertex : triangle_vertices)
         {
-            vec_dot = dot(normal, triangle_vertices[i]);
+            vec_dot = dot(normal, vertex);
             if (vec_dot < dnear)
                 dnear = vec_dot;
             if (vec_dot > dfar)
@@ -75,24 +244,117 @@ public:
     }
 
     /**
-     * Note: Same logic as hittable_list
+     * Instanced under the tlas: rays reaching this mesh traverse its own blas
+     * and intersect the triangle store directly, the record is only filled for the closest triangle
     */
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-        hit_record temp_rec;
-        bool hit_anything = false;
+        triangle_store::ray_lanes lanes(r);
         double closest_so_far = ray_t.max;
+        int closest_triangle = -1;
+        double closest_b1 = 0, closest_b2 = 0;
+        auto leaf = [&](unsigned int first, unsigned int count)
+        {
+            double t, b1, b2;
+            int i = triangles.intersect(first, count, lanes, ray_t.min, closest_so_far, t, b1, b2);
+            if (i >= 0)
+            {
+                closest_so_far = t;
+                closest_triangle = i;
+                closest_b1 = b1;
+                closest_b2 = b2;
+            }
+        };
+        sah_closest_hit(blas, r, ray_t.min, closest_so_far, leaf);
+        if (closest_triangle < 0)
+            return false;
+        fill_record(r, closest_so_far, closest_triangle, closest_b1, closest_b2, rec);
+        return true;
+    }
 
-        for (const auto &triangle : triangles)
+    int hit_packet(const ray_packet &packet, int active, double *t_max, hit_record *recs) const override
+    {
+        int hit_mask = 0;
+        unsigned int closest_triangle[PACKET_SIZE];
+        double closest_b1[PACKET_SIZE], closest_b2[PACKET_SIZE];
+        triangle_store::ray_lanes lanes[PACKET_SIZE];
+        for (int k = 0; k < PACKET_SIZE; ++k)
+        {
+            if ((active >> k) & 1)
+                lanes[k] = triangle_store::ray_lanes(packet.rays[k]);
+        }
+        // the packet shares the blas traversal, a leaf is tested SIMD_WIDTH triangles at a time for each lane entering it
+        auto leaf = [&](unsigned int first, unsigned int count, int mask)
         {
-            if (triangle->hit(r, interval(ray_t.min, closest_so_far), temp_rec))
+            for (int k = 0; k < PACKET_SIZE; ++k)
             {
-                hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+                double t, b1, b2;
+                int i = (mask >> k) & 1 ? triangles.intersect(first, count, lanes[k], packet.t_min, t_max[k], t, b1, b2) : -1;
+                if (i >= 0)
+                {
+                    t_max[k] = t;
+                    closest_triangle[k] = i;
+                    closest_b1[k] = b1;
+                    closest_b2[k] = b2;
+                    hit_mask |= 1 << k;
+                }
             }
+        };
+        sah_packet_hit(blas, packet, active, t_max, leaf);
+        for (int k = 0; k < PACKET_SIZE; ++k)
+        {
+            if ((hit_mask >> k) & 1)
+                fill_record(packet.rays[k], t_max[k], closest_triangle[k], closest_b1[k], closest_b2[k], recs[k]);
         }
-        return hit_anything;
+        return hit_mask;
+    }
+
+    void register_materials(material_table &table) override
+    {
+        material_id = table.add(mat);
+    }
+
+    bool is_emissive() const override
+    {
+        return mat->emit_light().length_squared() > 0;
+    }
+
+    /**
+     * Uniform by area over the whole mesh: a triangle is picked with probability proportional to its area
+    */
+    bool sample_light(const point3 &origin, sampler &rng, light_sample &sample) const override
+    {
+        if (area_cdf.empty() || area_cdf.back() <= 0)
+            return false;
+        double u = random_double(rng) * area_cdf.back();
+        unsigned int i = std::upper_bound(area_cdf.begin(), area_cdf.end(), u) - area_cdf.begin();
+        i = std::min(i, num_triangles - 1);
+        point3 p = random_in_triangle(triangles.vertex(i), triangles.edge(1, i), triangles.edge(2, i), rng);
+        sample.pdf = area_light_pdf(origin, p, triangles.face_normal(i), area_cdf.back());
+        if (sample.pdf <= 0)
+            return false;
+        sample.distance = (p - origin).length();
+        sample.direction = (p - origin) / sample.distance;
+        sample.emitted = mat->emit_light();
+        return true;
+    }
+
+    double light_pdf(const point3 &origin, const hit_record &rec) const override
+    {
+        if (area_cdf.empty())
+            return 0;
+        return area_light_pdf(origin, rec.p, rec.normal, area_cdf.back());
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        triangle_store::ray_lanes lanes(r);
+        auto leaf = [&](unsigned int first, unsigned int count)
+        {
+            return triangles.occluded(first, count, lanes, ray_t.min, ray_t.max);
+        };
+        unsigned long long node_visits = 0;
+        return sah_any_hit(blas, r, ray_t, node_visits, leaf);
     }
 };
 
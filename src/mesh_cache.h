@@ -0,0 +1,253 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include "mapped_file.h"
+#include "mesh.h"
+#include "obj_parser.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+// bump whenever the layout below or the way a mesh is built changes, older cache files are then rebuilt
+#define MESH_CACHE_VERSION 3
+
+/**
+ * 64 bit FNV-1a hash, identifies the source file a cache was built from
+*/
+inline uint64_t fnv1a_hash(const char *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Binary cache of a built mesh, written next to its OBJ file (as file.obj.cache) on the first load.
+ * Holds the vertex positions, the triangle store (vertices and face normals in blas leaf order), the blas nodes
+ * and the vertex normals with the normal index of each triangle corner, so later runs map it and copy the arrays
+ * in bulk instead of parsing, triangulating and building the blas again.
+ * The cache is only used while its header matches the version and the hash of the current OBJ file.
+ * Layout: header | vertices (3 doubles each) | the 12 float arrays of the triangle store | blas nodes
+ *         | vertex normals (3 doubles each) | corner normal indices
+*/
+class mesh_cache
+{
+public:
+    /**
+     * Mesh of the OBJ file at obj_path, read from its cache if it is up to date, otherwise
+     * parsed and built on num_threads threads (0 for one per hardware thread) and written to the cache
+     * @return: null if the OBJ file cannot be read
+    */
+    static shared_ptr<mesh> load_obj(const std::string &obj_path, shared_ptr<material> mat, unsigned int num_threads = 0)
+    {
+        mapped_file source;
+        if (!source.open(obj_path))
+        {
+            cerr << "Error opening file!" << endl;
+            return nullptr;
+        }
+        uint64_t hash = fnv1a_hash(source.data(), source.size());
+        source.close();
+
+        std::string cache_path = obj_path + ".cache";
+        shared_ptr<mesh> m = read(cache_path, hash, mat);
+        if (m)
+            return m;
+        mesh_source geometry;
+        if (Parser::parse_obj_mesh(obj_path, geometry, num_threads))
+            return nullptr;
+        m = make_shared<mesh>(std::move(geometry), mat, num_threads);
+        if (!write(cache_path, hash, *m))
+            cerr << "Could not write mesh cache " << cache_path << endl;
+        return m;
+    }
+
+    /**
+     * @return: the cached mesh, null if the file is missing, truncated or was built from another source or version
+    */
+    static shared_ptr<mesh> read(const std::string &path, uint64_t source_hash, shared_ptr<material> mat)
+    {
+        mapped_file file;
+        header h;
+        if (!file.open(path) || file.size() < sizeof(h))
+            return nullptr;
+        memcpy(&h, file.data(), sizeof(h));
+        if (memcmp(h.magic, magic(), sizeof(h.magic)) != 0 || h.version != MESH_CACHE_VERSION ||
+            h.source_hash != source_hash || h.store_padding != TRIANGLE_STORE_PADDING ||
+            h.num_store_entries != h.num_triangles + h.store_padding || file.size() != file_size(h) ||
+            (h.num_corner_normals != 0 && h.num_corner_normals != 3ull * h.num_triangles))
+            return nullptr;
+
+        shared_ptr<mesh> m(new mesh(mat));
+        const char *p = file.data() + sizeof(h);
+        m->num_triangles = h.num_triangles;
+        m->triangle_vertices.resize(h.num_vertices);
+        for (uint64_t i = 0; i < h.num_vertices; ++i)
+            m->triangle_vertices[i] = read_vec3(p);
+        std::vector<float> *arrays[12];
+        store_arrays(m->triangles, arrays);
+        for (std::vector<float> *array : arrays)
+        {
+            array->resize(h.num_store_entries);
+            memcpy(array->data(), p, h.num_store_entries * sizeof(float));
+            p += h.num_store_entries * sizeof(float);
+        }
+        m->triangles.num_triangles = h.num_triangles;
+        m->blas.resize(h.num_nodes);
+        if (h.num_nodes)
+            memcpy(m->blas.data(), p, h.num_nodes * sizeof(sah_node));
+        p += h.num_nodes * sizeof(sah_node);
+        m->vertex_normals.resize(h.num_normals);
+        for (uint64_t i = 0; i < h.num_normals; ++i)
+            m->vertex_normals[i] = read_vec3(p);
+        m->corner_normals.resize(h.num_corner_normals);
+        if (h.num_corner_normals) // an empty vector may have no data to copy to
+            memcpy(m->corner_normals.data(), p, h.num_corner_normals * sizeof(unsigned int));
+        if (!valid_blas(m->blas, h.num_triangles) || !valid_corner_normals(m->corner_normals, h.num_normals))
+            return nullptr;
+        m->set_up_material_data();
+        return m;
+    }
+
+    /**
+     * Writes to a temporary file renamed over path once complete, so a reader never sees half a cache
+     * @return: false if the file could not be written
+    */
+    static bool write(const std::string &path, uint64_t source_hash, const mesh &m)
+    {
+        header h;
+        memcpy(h.magic, magic(), sizeof(h.magic));
+        h.version = MESH_CACHE_VERSION;
+        h.num_triangles = m.num_triangles;
+        h.source_hash = source_hash;
+        h.num_vertices = m.triangle_vertices.size();
+        h.num_store_entries = m.triangles.v0[0].size();
+        h.store_padding = TRIANGLE_STORE_PADDING;
+        h.num_nodes = m.blas.size();
+        h.num_normals = m.vertex_normals.size();
+        h.num_corner_normals = m.corner_normals.size();
+
+        // unique per process, so concurrent first runs on the same OBJ file do not write into each other's file
+        std::string temp_path = path + "." + std::to_string(getpid()) + ".tmp";
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        for (const vec3 &v : m.triangle_vertices)
+            write_vec3(out, v);
+        const std::vector<float> *arrays[12];
+        store_arrays(m.triangles, arrays);
+        for (const std::vector<float> *array : arrays)
+            out.write(reinterpret_cast<const char *>(array->data()), array->size() * sizeof(float));
+        out.write(reinterpret_cast<const char *>(m.blas.data()), m.blas.size() * sizeof(sah_node));
+        for (const vec3 &n : m.vertex_normals)
+            write_vec3(out, n);
+        out.write(reinterpret_cast<const char *>(m.corner_normals.data()), m.corner_normals.size() * sizeof(unsigned int));
+        out.close();
+        if (!out || std::rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_triangles;
+        uint64_t source_hash;
+        uint64_t num_vertices;
+        uint64_t num_store_entries; // length of each triangle store array, triangles plus padding
+        uint64_t store_padding;     // degenerate triangles after the last one, TRIANGLE_STORE_PADDING
+        uint64_t num_nodes;
+        uint64_t num_normals;
+        uint64_t num_corner_normals; // 3 per triangle, 0 for a flat mesh
+    };
+
+    static const char *magic() { return "RTMESH\0\0"; }
+
+    static size_t file_size(const header &h)
+    {
+        return sizeof(h) + h.num_vertices * 3 * sizeof(double) + 12 * h.num_store_entries * sizeof(float) +
+               h.num_nodes * sizeof(sah_node) + h.num_normals * 3 * sizeof(double) +
+               h.num_corner_normals * sizeof(unsigned int);
+    }
+
+    /**
+     * The blas of a cache whose hash matches can still be corrupted: children must come after their parent
+     * inside the array with a single parent each, leaves must lie inside the triangles and the tree
+     * must not be deeper than the fixed traversal stacks
+    */
+    static bool valid_blas(const std::vector<sah_node> &nodes, uint64_t num_triangles)
+    {
+        std::vector<int> depth(nodes.size(), -1);
+        if (!nodes.empty())
+            depth[0] = 0;
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            const sah_node &node = nodes[i];
+            if (depth[i] < 0)
+                return false;
+            if (node.is_leaf())
+            {
+                if (static_cast<uint64_t>(node.offset) + node.count > num_triangles)
+                    return false;
+                continue;
+            }
+            if (depth[i] >= SAH_MAX_DEPTH || node.offset <= i + 1 || node.offset >= nodes.size() ||
+                depth[i + 1] >= 0 || depth[node.offset] >= 0)
+                return false;
+            depth[i + 1] = depth[node.offset] = depth[i] + 1;
+        }
+        return true;
+    }
+
+    // every triangle has either three normals or none
+    static bool valid_corner_normals(const std::vector<unsigned int> &corners, uint64_t num_normals)
+    {
+        for (size_t i = 0; i < corners.size(); i += 3)
+        {
+            bool flat = corners[i] == MESH_NO_NORMAL && corners[i + 1] == MESH_NO_NORMAL && corners[i + 2] == MESH_NO_NORMAL;
+            if (!flat && (corners[i] >= num_normals || corners[i + 1] >= num_normals || corners[i + 2] >= num_normals))
+                return false;
+        }
+        return true;
+    }
+
+    // vectors are stored as 3 doubles, without the padding lane of the simd vec3
+    static vec3 read_vec3(const char *&p)
+    {
+        double e[3];
+        memcpy(e, p, sizeof(e));
+        p += sizeof(e);
+        return vec3(e[0], e[1], e[2]);
+    }
+
+    static void write_vec3(std::ofstream &out, const vec3 &v)
+    {
+        double e[3] = {v.x(), v.y(), v.z()};
+        out.write(reinterpret_cast<const char *>(e), sizeof(e));
+    }
+
+    // the arrays of a (const) triangle store in file order
+    template <typename store_type, typename array_type>
+    static void store_arrays(store_type &store, array_type *arrays[12])
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            arrays[a] = &store.v0[a];
+            arrays[3 + a] = &store.v1[a];
+            arrays[6 + a] = &store.v2[a];
+            arrays[9 + a] = &store.normal[a];
+        }
+    }
+};
+
+#endif
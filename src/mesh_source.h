@@ -0,0 +1,23 @@
+#ifndef MESH_SOURCE_H
+#define MESH_SOURCE_H
+
+#include "vec3.h"
+#include <vector>
+
+/**
+ * Triangulated, indexed geometry a mesh is built from.
+ * Parser::parse_obj_mesh streams an OBJ file straight into it, and the mesh takes its buffers over
+ * (moving the positions and normals, consuming the indices) instead of copying them
+*/
+struct mesh_source
+{
+    std::vector<vec3> positions;
+    std::vector<unsigned int> triangles; // 3 position indices per triangle
+
+    // optional smooth shading normals and the normal index of each triangle corner, like triangles.
+    // Without triangle_normals the normals are taken per vertex if there is one for every position
+    std::vector<vec3> normals;
+    std::vector<unsigned int> triangle_normals;
+};
+
+#endif
@@ -1,16 +1,236 @@
 #ifndef OBJ_PARSER_H
 #define OBJ_PARSER_H
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <utility>
+#include <vector>
 
+#include "mapped_file.h"
+#include "mesh_source.h"
+#include "scheduler.h"
 #include "vec3.h"
 
 using namespace std;
 // world.add(make_shared<mesh>(npolys, faceIndex, vertsIndex, P, material_center));
 
+/**
+ * Scanners for the memory mapped parser, they read from p up to end and leave p past what they consumed
+*/
+inline bool obj_is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool obj_is_digit(char c) { return c >= '0' && c <= '9'; }
+
+inline void obj_skip_space(const char *&p, const char *end)
+{
+    while (p < end && obj_is_space(*p))
+        ++p;
+}
+
+// moves p to the start of the next line
+inline void obj_skip_line(const char *&p, const char *end)
+{
+    while (p < end && *p != '\n')
+        ++p;
+    if (p < end)
+        ++p;
+}
+
+inline bool obj_parse_int(const char *&p, const char *end, long &value)
+{
+    const char *q = p;
+    bool negative = q < end && *q == '-';
+    if (q < end && (*q == '-' || *q == '+'))
+        ++q;
+    if (q == end || !obj_is_digit(*q))
+        return false;
+    long magnitude = 0;
+    for (; q < end && obj_is_digit(*q); ++q)
+        magnitude = magnitude * 10 + (*q - '0');
+    value = negative ? -magnitude : magnitude;
+    p = q;
+    return true;
+}
+
+/**
+ * Decimal numbers with at most 19 significant digits and a power of ten up to 22 are
+ * one correctly rounded multiplication or division of two exact doubles, the same result strtod gives.
+ * That covers the numbers exporters write, anything else goes through strtod
+*/
+inline bool obj_parse_double(const char *&p, const char *end, double &value)
+{
+    static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                           1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *q = p;
+    bool negative = q < end && *q == '-';
+    if (q < end && (*q == '-' || *q == '+'))
+        ++q;
+    const char *unsigned_start = q;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool exact = true, any_digit = false;
+    for (; q < end && obj_is_digit(*q); ++q, any_digit = true)
+    {
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + (*q - '0');
+            digits += mantissa != 0;
+        }
+        else
+        {
+            ++exponent;
+            exact = false;
+        }
+    }
+    if (q < end && *q == '.')
+    {
+        for (++q; q < end && obj_is_digit(*q); ++q, any_digit = true)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + (*q - '0');
+                digits += mantissa != 0;
+                --exponent;
+            }
+            else
+                exact = false;
+        }
+    }
+    if (!any_digit)
+        return false;
+    if (q < end && (*q == 'e' || *q == 'E'))
+    {
+        const char *e = q + 1;
+        long power;
+        if (obj_parse_int(e, end, power))
+        {
+            exponent += power < -400 ? -400 : power > 400 ? 400 : power;
+            q = e;
+        }
+    }
+    if (exact && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double m = static_cast<double>(mantissa);
+        value = exponent < 0 ? m / powers_of_ten[-exponent] : m * powers_of_ten[exponent];
+    }
+    else
+        value = strtod(string(unsigned_start, q).c_str(), nullptr);
+    if (negative)
+        value = -value;
+    p = q;
+    return true;
+}
+
+// index of a face corner without a texture coordinate or normal
+#define OBJ_NO_INDEX 0xffffffffu
+
+/**
+ * What one thread of the memory mapped parser read from its part of the file.
+ * Positions, texture coordinates and normals are attributes 0, 1 and 2, each face corner has an index into each.
+ * Positive indices are global already, negative ones count back from the elements read so far
+ * and are kept relative to the chunk's first element until the merge
+*/
+struct obj_chunk
+{
+    struct relative_ref
+    {
+        size_t slot;   // face corner
+        int attribute;
+        long index;    // relative to the chunk's first element of the attribute
+    };
+
+    std::vector<vec3> elements[3];
+    std::vector<unsigned int> indices[3];
+    std::vector<unsigned int> face_index;
+    std::vector<relative_ref> relative_index;
+    bool has_index[3] = {false, false, false};
+
+    void parse(const char *p, const char *end)
+    {
+        while (p < end)
+        {
+            obj_skip_space(p, end);
+            int attribute = element_attribute(p, end);
+            if (attribute >= 0)
+            {
+                double e[3] = {0, 0, 0};
+                for (int i = 0; i < 3; ++i)
+                {
+                    obj_skip_space(p, end);
+                    obj_parse_double(p, end, e[i]);
+                }
+                elements[attribute].emplace_back(e[0], e[1], e[2]);
+            }
+            else if (end - p > 1 && p[0] == 'f' && obj_is_space(p[1]))
+            {
+                size_t first = indices[0].size();
+                long index[3];
+                p += 2;
+                obj_skip_space(p, end);
+                // v, v/t, v//n or v/t/n, an index of 0 marks a missing one
+                while (obj_parse_int(p, end, index[0]))
+                {
+                    index[1] = index[2] = 0;
+                    if (p < end && *p == '/')
+                    {
+                        ++p;
+                        obj_parse_int(p, end, index[1]);
+                        if (p < end && *p == '/')
+                        {
+                            ++p;
+                            obj_parse_int(p, end, index[2]);
+                        }
+                    }
+                    size_t slot = indices[0].size();
+                    for (int a = 0; a < 3; ++a)
+                        add_index(a, index[a], slot);
+                    while (p < end && !obj_is_space(*p) && *p != '\n')
+                        ++p;
+                    obj_skip_space(p, end);
+                }
+                // the mesh fans faces into triangles, so drop degenerate ones
+                if (indices[0].size() - first >= 3)
+                    face_index.push_back(indices[0].size() - first);
+                else
+                {
+                    while (!relative_index.empty() && relative_index.back().slot >= first)
+                        relative_index.pop_back();
+                    for (int a = 0; a < 3; ++a)
+                        indices[a].resize(first);
+                }
+            }
+            obj_skip_line(p, end);
+        }
+    }
+
+private:
+    // attribute of a v, vt or vn line, with p moved past the keyword, -1 for other lines
+    static int element_attribute(const char *&p, const char *end)
+    {
+        if (end - p < 2 || p[0] != 'v')
+            return -1;
+        int attribute = obj_is_space(p[1]) ? 0 : p[1] == 't' ? 1 : p[1] == 'n' ? 2 : -1;
+        int length = attribute == 0 ? 1 : 2;
+        if (attribute < 0 || (attribute > 0 && (end - p < 3 || !obj_is_space(p[2]))))
+            return -1;
+        p += length;
+        return attribute;
+    }
+
+    void add_index(int attribute, long index, size_t slot)
+    {
+        if (index != 0)
+            has_index[attribute] = true;
+        if (index < 0)
+            relative_index.push_back(relative_ref{slot, attribute, static_cast<long>(elements[attribute].size()) + index});
+        indices[attribute].push_back(index == 0 ? OBJ_NO_INDEX : static_cast<unsigned int>(index - 1));
+    }
+};
+
 class Parser
 {
     // private:
@@ -20,6 +240,16 @@ public:
     std::unique_ptr<unsigned int[]> face_index;
     std::unique_ptr<unsigned int[]> vertex_index;
     std::unique_ptr<vec3[]> vertices;
+    unsigned int num_vertices = 0;
+
+    // vt and vn lines, and their index for each face corner like vertex_index (OBJ_NO_INDEX where a corner has none).
+    // Only read by parse_obj_mapped, the index arrays stay null if no face refers to the attribute
+    unsigned int num_texcoords = 0;
+    unsigned int num_normals = 0;
+    std::unique_ptr<vec3[]> texcoords;
+    std::unique_ptr<vec3[]> normals;
+    std::unique_ptr<unsigned int[]> texcoord_index;
+    std::unique_ptr<unsigned int[]> normal_index;
     Parser() {}
 
     /**
@@ -121,10 +351,202 @@ public:
             face_index[i] = face_index_vec[i];
         }
         num_faces = len_face_indices;
+        num_vertices = len_vertices;
 
         inputFile.close(); // Close the file
         return 0;
     }
+
+    /**
+     * Same arrays as parse_obj, reading the memory mapped file in newline aligned chunks on
+     * num_threads threads (0 for one per hardware thread) without a stream or per line allocations.
+     * Also reads the vt and vn lines and face corner indices, accepts negative (relative) indices
+     * and mixed face formats, and drops faces with fewer than 3 vertices
+     * @return: 1 if the file cannot be read or a face refers to a vertex missing from it
+    */
+    int parse_obj_mapped(string file_name, unsigned int num_threads = 0)
+    {
+        mapped_file file;
+        if (!file.open(file_name))
+        {
+            cerr << "Error opening file!" << endl;
+            return 1;
+        }
+        scheduler pool(num_threads);
+        std::vector<obj_chunk> chunks = parse_chunks(file, pool);
+        size_t num_chunks = chunks.size();
+
+        std::vector<size_t> element_offset[3], index_offset(num_chunks + 1, 0), face_offset(num_chunks + 1, 0);
+        bool has_index[3];
+        count_elements(chunks, element_offset, has_index);
+        for (size_t i = 0; i < num_chunks; ++i)
+        {
+            index_offset[i + 1] = index_offset[i] + chunks[i].indices[0].size();
+            face_offset[i + 1] = face_offset[i] + chunks[i].face_index.size();
+        }
+        std::unique_ptr<vec3[]> *element_arrays[3] = {&vertices, &texcoords, &normals};
+        std::unique_ptr<unsigned int[]> *index_arrays[3] = {&vertex_index, &texcoord_index, &normal_index};
+        for (int a = 0; a < 3; ++a)
+        {
+            element_arrays[a]->reset(new vec3[element_offset[a][num_chunks]]);
+            index_arrays[a]->reset(has_index[a] ? new unsigned int[index_offset[num_chunks]] : nullptr);
+        }
+        face_index = std::unique_ptr<unsigned int[]>(new unsigned int[face_offset[num_chunks]]);
+        pool.parallel_for(num_chunks, [&](unsigned int i)
+                          {
+                              const obj_chunk &chunk = chunks[i];
+                              for (int a = 0; a < 3; ++a)
+                              {
+                                  std::copy(chunk.elements[a].begin(), chunk.elements[a].end(), &(*element_arrays[a])[element_offset[a][i]]);
+                                  if (*index_arrays[a])
+                                      std::copy(chunk.indices[a].begin(), chunk.indices[a].end(), &(*index_arrays[a])[index_offset[i]]);
+                              }
+                              std::copy(chunk.face_index.begin(), chunk.face_index.end(), &face_index[face_offset[i]]);
+                              for (const auto &relative : chunk.relative_index)
+                                  (*index_arrays[relative.attribute])[index_offset[i] + relative.slot] =
+                                      static_cast<unsigned int>(element_offset[relative.attribute][i] + relative.index); });
+        num_vertices = element_offset[0][num_chunks];
+        for (size_t k = 0; k < index_offset[num_chunks]; ++k)
+        {
+            // also catches "f 0", stored as OBJ_NO_INDEX, and relative indices reaching before the first vertex
+            if (vertex_index[k] >= num_vertices)
+            {
+                cerr << "Face refers to a vertex missing from " << file_name << endl;
+                return 1;
+            }
+        }
+        num_texcoords = element_offset[1][num_chunks];
+        num_normals = element_offset[2][num_chunks];
+        num_faces = face_offset[num_chunks];
+        return 0;
+    }
+
+    /**
+     * Streams the file straight into the triangulated, indexed storage of a mesh, without the arrays above.
+     * Chunks are parsed as in parse_obj_mapped, then each one fans its faces into source.triangles at its own
+     * offset and is freed right away. A file read as a single chunk hands its positions and normals over
+     * without a copy. Texture coordinates are skipped, meshes do not use them
+     * @return: 1 if the file cannot be read or a face refers to a vertex missing from it, source is left empty then
+    */
+    static int parse_obj_mesh(string file_name, mesh_source &source, unsigned int num_threads = 0)
+    {
+        mapped_file file;
+        if (!file.open(file_name))
+        {
+            cerr << "Error opening file!" << endl;
+            return 1;
+        }
+        scheduler pool(num_threads);
+        std::vector<obj_chunk> chunks = parse_chunks(file, pool);
+        file.close();
+        size_t num_chunks = chunks.size();
+
+        std::vector<size_t> element_offset[3], triangle_offset(num_chunks + 1, 0);
+        bool has_index[3];
+        count_elements(chunks, element_offset, has_index);
+        for (size_t i = 0; i < num_chunks; ++i)
+        {
+            size_t num_triangles = 0;
+            for (unsigned int corners : chunks[i].face_index)
+                num_triangles += corners - 2;
+            triangle_offset[i + 1] = triangle_offset[i] + num_triangles;
+        }
+        source = mesh_source();
+        if (num_chunks == 1)
+        {
+            source.positions.swap(chunks[0].elements[0]);
+            source.normals.swap(chunks[0].elements[2]);
+        }
+        else
+        {
+            source.positions.resize(element_offset[0][num_chunks]);
+            source.normals.resize(element_offset[2][num_chunks]);
+        }
+        source.triangles.resize(3 * triangle_offset[num_chunks]);
+        source.triangle_normals.resize(has_index[2] ? 3 * triangle_offset[num_chunks] : 0);
+        size_t num_positions = element_offset[0][num_chunks];
+        std::vector<char> missing_vertex(num_chunks, false);
+        pool.parallel_for(num_chunks, [&](unsigned int i)
+                          {
+                              obj_chunk &chunk = chunks[i];
+                              for (const auto &relative : chunk.relative_index)
+                                  chunk.indices[relative.attribute][relative.slot] =
+                                      static_cast<unsigned int>(element_offset[relative.attribute][i] + relative.index);
+                              std::copy(chunk.elements[0].begin(), chunk.elements[0].end(), source.positions.begin() + element_offset[0][i]);
+                              std::copy(chunk.elements[2].begin(), chunk.elements[2].end(), source.normals.begin() + element_offset[2][i]);
+                              unsigned int *triangle = source.triangles.data() + 3 * triangle_offset[i];
+                              unsigned int *normal = has_index[2] ? source.triangle_normals.data() + 3 * triangle_offset[i] : nullptr;
+                              size_t k = 0;
+                              for (unsigned int corners : chunk.face_index)
+                              {
+                                  for (unsigned int j = 0; j + 2 < corners; ++j)
+                                  {
+                                      size_t fan[3] = {k, k + j + 1, k + j + 2};
+                                      for (size_t corner : fan)
+                                      {
+                                          // "f 0" is stored as OBJ_NO_INDEX, so it is out of range as well
+                                          if (chunk.indices[0][corner] >= num_positions)
+                                              missing_vertex[i] = true;
+                                          *triangle++ = chunk.indices[0][corner];
+                                          if (normal)
+                                              *normal++ = chunk.indices[2][corner];
+                                      }
+                                  }
+                                  k += corners;
+                              }
+                              chunk = obj_chunk(); });
+        if (std::find(missing_vertex.begin(), missing_vertex.end(), true) != missing_vertex.end())
+        {
+            cerr << "Face refers to a vertex missing from " << file_name << endl;
+            source = mesh_source();
+            return 1;
+        }
+        return 0;
+    }
+
+private:
+    // parses the mapped file in newline aligned chunks of at least 1MB, a few per thread so the scheduler can balance them
+    static std::vector<obj_chunk> parse_chunks(const mapped_file &file, scheduler &pool)
+    {
+        const char *begin = file.data();
+        const char *end = begin + file.size();
+        const size_t min_chunk = 1 << 20;
+        size_t num_chunks = std::max<size_t>(1, std::min<size_t>(pool.threads() * 4, file.size() / min_chunk));
+        std::vector<const char *> starts(num_chunks + 1, end);
+        starts[0] = begin;
+        for (size_t i = 1; i < num_chunks; ++i)
+        {
+            const char *p = std::max(begin + file.size() * i / num_chunks, starts[i - 1]);
+            if (p > begin && p[-1] != '\n')
+                obj_skip_line(p, end);
+            starts[i] = p;
+        }
+        std::vector<obj_chunk> chunks(num_chunks);
+        pool.parallel_for(num_chunks, [&](unsigned int i)
+                          { chunks[i].parse(starts[i], starts[i + 1]); });
+        return chunks;
+    }
+
+    /**
+     * element_offset[a][i]: elements of attribute a read by the chunks before chunk i, up to i = number of chunks
+     * has_index[a]: whether any face corner refers to attribute a, always true for positions
+    */
+    static void count_elements(const std::vector<obj_chunk> &chunks, std::vector<size_t> element_offset[3], bool has_index[3])
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            element_offset[a].assign(chunks.size() + 1, 0);
+            has_index[a] = a == 0;
+        }
+        for (size_t i = 0; i < chunks.size(); ++i)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                element_offset[a][i + 1] = element_offset[a][i] + chunks[i].elements[a].size();
+                has_index[a] = has_index[a] || chunks[i].has_index[a];
+            }
+        }
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,120 @@
+#ifndef PATH_QUEUE_H
+#define PATH_QUEUE_H
+
+#include "hittable.h"
+#include <vector>
+
+/**
+ * Structure of arrays state of the paths in flight in wavefront mode.
+ * Every stage of the wavefront integrator is one loop over the queue that only touches the arrays it needs
+*/
+struct path_queue
+{
+    std::vector<ray> rays;
+    std::vector<colour> throughput;
+    std::vector<colour> radiance;
+    std::vector<double> bsdf_pdf; // density the last bounce scattered the ray with, 0 for camera rays and specular bounces
+    std::vector<int> depth;       // surface hits so far, including the coming one
+    std::vector<int> pixel;       // index of the pixel in its tile
+    std::vector<sampler> rngs;
+    std::vector<hit_record> recs;
+    std::vector<char> hit;
+    std::vector<char> alive;
+
+    size_t size() const { return rays.size(); }
+
+    void reserve(size_t n)
+    {
+        rays.reserve(n);
+        throughput.reserve(n);
+        radiance.reserve(n);
+        bsdf_pdf.reserve(n);
+        depth.reserve(n);
+        pixel.reserve(n);
+        rngs.reserve(n);
+        recs.reserve(n);
+        hit.reserve(n);
+        alive.reserve(n);
+    }
+
+    // a new path starting with camera ray r
+    void push(const ray &r, int pixel_index, const sampler &rng)
+    {
+        rays.push_back(r);
+        throughput.push_back(colour(1, 1, 1));
+        radiance.push_back(colour(0, 0, 0));
+        bsdf_pdf.push_back(0);
+        depth.push_back(1);
+        pixel.push_back(pixel_index);
+        rngs.push_back(rng);
+        recs.push_back(hit_record());
+        hit.push_back(false);
+        alive.push_back(true);
+    }
+
+    /**
+     * Drops the paths that are no longer alive, keeping the order of the others
+    */
+    void compact()
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < size(); ++i)
+        {
+            if (!alive[i])
+                continue;
+            if (kept != i)
+            {
+                rays[kept] = rays[i];
+                throughput[kept] = throughput[i];
+                radiance[kept] = radiance[i];
+                bsdf_pdf[kept] = bsdf_pdf[i];
+                depth[kept] = depth[i];
+                pixel[kept] = pixel[i];
+                rngs[kept] = rngs[i];
+                alive[kept] = true;
+            }
+            ++kept;
+        }
+        rays.resize(kept);
+        throughput.resize(kept);
+        radiance.resize(kept);
+        bsdf_pdf.resize(kept);
+        depth.resize(kept);
+        pixel.resize(kept);
+        rngs.resize(kept);
+        recs.resize(kept);
+        hit.resize(kept);
+        alive.resize(kept);
+    }
+};
+
+/**
+ * Shadow rays of next event estimation, and the radiance they add to their path if unoccluded
+*/
+struct shadow_queue
+{
+    std::vector<ray> rays;
+    std::vector<double> distance;
+    std::vector<colour> contribution;
+    std::vector<int> path;
+
+    size_t size() const { return rays.size(); }
+
+    void clear()
+    {
+        rays.clear();
+        distance.clear();
+        contribution.clear();
+        path.clear();
+    }
+
+    void push(const ray &r, double d, const colour &c, int path_index)
+    {
+        rays.push_back(r);
+        distance.push_back(d);
+        contribution.push_back(c);
+        path.push_back(path_index);
+    }
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "ray.h"
+#include "simd.h"
+#include <limits>
+
+#define PACKET_SIZE SIMD_WIDTH
+
+/**
+ * Coherent rays traced together, e.g. camera rays of neighbouring pixels.
+ * Origins and directions are also kept lane wise so that every lane is tested
+ * against a node or primitive with the same instructions
+*/
+struct ray_packet
+{
+    ray rays[PACKET_SIZE];
+    vdouble4 orig[3];
+    vdouble4 dir[3];
+    vdouble4 inv_dir[3];
+    double t_min = 0.001;
+    int active = 0; // bit i set when lane i carries a ray
+
+    // must be called after filling rays
+    void set_up()
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            double o[PACKET_SIZE], d[PACKET_SIZE];
+            for (int i = 0; i < PACKET_SIZE; ++i)
+            {
+                //inactive lanes repeat a live ray so they never produce nan or inf in the kernels
+                const ray &r = rays[(active >> i) & 1 ? i : first_active()];
+                o[i] = r.origin()[a];
+                d[i] = r.direction()[a];
+            }
+            orig[a] = vdouble4::load(o);
+            dir[a] = vdouble4::load(d);
+            inv_dir[a] = vdouble4(1.0) / dir[a];
+        }
+    }
+
+    int first_active() const
+    {
+        for (int i = 0; i < PACKET_SIZE; ++i)
+        {
+            if ((active >> i) & 1)
+                return i;
+        }
+        return 0;
+    }
+};
+
+/**
+ * Smallest and largest lane values among the lanes set in mask
+*/
+inline double lane_min(const vdouble4 &v, int mask)
+{
+    double lanes[PACKET_SIZE];
+    v.store(lanes);
+    double m = std::numeric_limits<double>::infinity();
+    for (int i = 0; i < PACKET_SIZE; ++i)
+    {
+        if ((mask >> i) & 1 && lanes[i] < m)
+            m = lanes[i];
+    }
+    return m;
+}
+
+inline double lane_max(const double *lanes, int mask)
+{
+    double m = -std::numeric_limits<double>::infinity();
+    for (int i = 0; i < PACKET_SIZE; ++i)
+    {
+        if ((mask >> i) & 1 && lanes[i] > m)
+            m = lanes[i];
+    }
+    return m;
+}
+
+#endif
@@ -0,0 +1,702 @@
+#ifndef SAH_BVH_H
+#define SAH_BVH_H
+
+#include "acceleration.h"
+#include "interval.h"
+#include "scheduler.h"
+#include <algorithm>
+#include <chrono>
+
+#define SAH_NUM_BINS 16
+#define SAH_MAX_LEAF_SIZE 4
+#define SAH_MAX_DEPTH 64
+#define SAH_TRAVERSAL_COST 1.0
+#define SAH_INTERSECTION_COST 1.0
+#define SAH_TASK_SIZE 4096   // smallest subtree handed to a task of the parallel build
+#define SAH_BLOCK_SIZE 16384 // top level nodes are binned in parallel blocks of at least this many primitives
+
+/**
+ * Axis aligned bounding box used by the sah builder
+*/
+struct aabb
+{
+    double min[3] = {infinity, infinity, infinity};
+    double max[3] = {-infinity, -infinity, -infinity};
+
+    void extend(const aabb &box)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            min[a] = std::min(min[a], box.min[a]);
+            max[a] = std::max(max[a], box.max[a]);
+        }
+    }
+
+    void extend(const point3 &p)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            min[a] = std::min(min[a], p[a]);
+            max[a] = std::max(max[a], p[a]);
+        }
+    }
+
+    double surface_area() const
+    {
+        double dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+        if (dx < 0 || dy < 0 || dz < 0)
+            return 0; // empty box
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
+    point3 centroid() const
+    {
+        return point3(min[0] + max[0], min[1] + max[1], min[2] + max[2]) * 0.5;
+    }
+};
+
+/**
+ * Ray side of the box slab tests, computed once per ray
+*/
+struct aabb_ray
+{
+#if SIMD_VECTORIZED
+    vdouble4 orig;
+    vdouble4 inv_dir; // lane 3 is 1, so the padding lane of a node is the slab (-inf, inf)
+#else
+    point3 orig;
+    vec3 inv_dir;
+#endif
+    aabb_ray(const ray &r)
+    {
+        point3 o = r.origin();
+        vec3 d = r.direction();
+#if SIMD_VECTORIZED
+        orig = vdouble4(o.x(), o.y(), o.z(), 0);
+        inv_dir = vdouble4(1.0) / vdouble4(d.x(), d.y(), d.z(), 1);
+#else
+        orig = o;
+        inv_dir = vec3(1 / d.x(), 1 / d.y(), 1 / d.z());
+#endif
+    }
+};
+
+/**
+ * Node of the flattened binary bvh (40 bytes).
+ * Nodes are stored depth first: the left child of an interior node is the next node in the array.
+ * The bounds are padded to 4 lanes with an infinite slab, so they load as one vector
+*/
+struct sah_node
+{
+    float bounds_min[4];
+    float bounds_max[4];
+    unsigned int offset; // leaf: first entry in the primitive order, interior: index of the right child
+    unsigned int count;  // number of primitives in a leaf, 0 for interior nodes
+
+    bool is_leaf() const { return count > 0; }
+
+    void set_bounds(const aabb &box)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            bounds_min[a] = round_down(box.min[a]);
+            bounds_max[a] = round_up(box.max[a]);
+        }
+        bounds_min[3] = -infinity;
+        bounds_max[3] = infinity;
+    }
+
+    /**
+     * Slab test against a single ray
+     * @param tnear: set to the entry distance on a hit
+    */
+    bool hit(const aabb_ray &ar, double tmin, double tmax, double &tnear) const
+    {
+#if SIMD_VECTORIZED
+        //x, y, z in lanes 0-2, the padding in lane 3 never limits the interval
+        vdouble4 t0 = (vdouble4::load(bounds_min) - ar.orig) * ar.inv_dir;
+        vdouble4 t1 = (vdouble4::load(bounds_max) - ar.orig) * ar.inv_dir;
+        tmin = std::max(tmin, hmax(min(t0, t1)));
+        tmax = std::min(tmax, hmin(max(t0, t1)));
+        tnear = tmin;
+        return tmin <= tmax;
+#else
+        for (int a = 0; a < 3; ++a)
+        {
+            double t0 = (bounds_min[a] - ar.orig[a]) * ar.inv_dir[a];
+            double t1 = (bounds_max[a] - ar.orig[a]) * ar.inv_dir[a];
+            if (ar.inv_dir[a] < 0)
+                std::swap(t0, t1);
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+            if (tmax < tmin)
+                return false;
+        }
+        tnear = tmin;
+        return true;
+#endif
+    }
+
+    /**
+     * Slab test of all packet lanes against the node
+     * @return: mask of lanes entering the node, tnear holds their entry distances
+    */
+    int hit(const vdouble4 *orig, const vdouble4 *inv_dir, vdouble4 tmin, vdouble4 tmax, vdouble4 &tnear) const
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            vdouble4 t0 = (vdouble4(bounds_min[a]) - orig[a]) * inv_dir[a];
+            vdouble4 t1 = (vdouble4(bounds_max[a]) - orig[a]) * inv_dir[a];
+            tmin = max(tmin, min(t0, t1));
+            tmax = min(tmax, max(t0, t1));
+        }
+        tnear = tmin;
+        return movemask(tmin <= tmax);
+    }
+};
+
+/**
+ * Builds a binary bvh over a list of primitive bounds using the
+ * surface area heuristic evaluated on SAH_NUM_BINS bins per axis.
+ * Primitive agnostic so that it can be used for both the tlas and mesh blas.
+ * The top levels are split first, binning large nodes in parallel blocks, then the subtrees below
+ * them are built as parallel tasks into their own node arrays and spliced in depth first.
+ * Every split is the one a single thread takes, so the tree does not depend on the number of threads
+*/
+class sah_builder
+{
+public:
+    std::vector<sah_node> nodes;
+    std::vector<unsigned int> prim_indices; // leaf ranges index into this permutation of the primitives
+
+    // num_threads: 0 for one per hardware thread
+    void build(const std::vector<aabb> &prim_bounds, unsigned int num_threads = 0)
+    {
+        scheduler threads(num_threads);
+        pool = &threads;
+        bounds = &prim_bounds;
+        nodes.clear();
+        subtrees.clear();
+        prim_indices.resize(prim_bounds.size());
+        centroids.resize(prim_bounds.size());
+        threads.parallel_blocks(prim_bounds.size(), threads.blocks(prim_bounds.size(), SAH_BLOCK_SIZE),
+                                [&](size_t begin, size_t end, unsigned int)
+                                {
+                                    for (size_t i = begin; i < end; ++i)
+                                    {
+                                        prim_indices[i] = i;
+                                        centroids[i] = prim_bounds[i].centroid();
+                                    }
+                                });
+        if (!prim_bounds.empty())
+        {
+            //a few subtrees per thread, nodes are only left to a task once they are small enough
+            task_size = threads.threads() > 1 ? std::max<size_t>(SAH_TASK_SIZE, prim_bounds.size() / (8 * threads.threads())) : 0;
+            nodes.reserve(2 * prim_bounds.size());
+            nodes.push_back(sah_node());
+            build_node(nodes, 0, 0, prim_bounds.size(), 0, true);
+            build_subtrees();
+        }
+        centroids.clear();
+        pool = nullptr;
+    }
+
+private:
+    const std::vector<aabb> *bounds = nullptr;
+    std::vector<point3> centroids;
+    scheduler *pool = nullptr; // only set during build
+    size_t task_size = 0;      // top level nodes of at most this many primitives become subtree tasks, 0 builds on one thread
+
+    // top level node whose subtree is built by a task
+    struct subtree
+    {
+        unsigned int node_index;
+        unsigned int begin, end;
+        int depth;
+    };
+    std::vector<subtree> subtrees;
+
+    struct bin
+    {
+        aabb box;
+        unsigned int count = 0;
+    };
+
+    // bins of all three axes, an axis whose scale is 0 is not binned
+    struct node_bins
+    {
+        bin axes[3][SAH_NUM_BINS];
+    };
+
+    static void make_leaf(sah_node &node, unsigned int begin, unsigned int end)
+    {
+        node.offset = begin;
+        node.count = end - begin;
+    }
+
+    /**
+     * range(first, last, partial) over [begin, end), on parallel blocks for large top level nodes
+     * with the partial results combined by merge(result, partial). Only min, max and counts are merged,
+     * so the result is the same however the range is split
+    */
+    template <typename result_type, typename range_function, typename merge_function>
+    void reduce(unsigned int begin, unsigned int end, bool top, result_type &result, range_function range, merge_function merge)
+    {
+        unsigned int num_blocks = top ? pool->blocks(end - begin, SAH_BLOCK_SIZE) : 1;
+        if (num_blocks == 1)
+        {
+            range(begin, end, result);
+            return;
+        }
+        std::vector<result_type> partial(num_blocks);
+        pool->parallel_blocks(end - begin, num_blocks, [&](size_t first, size_t last, unsigned int b)
+                              { range(begin + first, begin + last, partial[b]); });
+        for (const result_type &p : partial)
+            merge(result, p);
+    }
+
+    void build_node(std::vector<sah_node> &out, unsigned int node_index, unsigned int begin, unsigned int end, int depth, bool top)
+    {
+        unsigned int n = end - begin;
+        if (top && n <= task_size)
+        {
+            subtrees.push_back(subtree{node_index, begin, end, depth});
+            return;
+        }
+
+        std::pair<aabb, aabb> boxes; // node bounds and centroid bounds
+        reduce(begin, end, top, boxes, [&](unsigned int first, unsigned int last, std::pair<aabb, aabb> &b)
+               {
+                   //accumulated in locals, which the bounds read cannot alias
+                   aabb range_box, range_centroids;
+                   for (unsigned int i = first; i < last; ++i)
+                   {
+                       range_box.extend((*bounds)[prim_indices[i]]);
+                       range_centroids.extend(centroids[prim_indices[i]]);
+                   }
+                   b = std::make_pair(range_box, range_centroids); },
+               [](std::pair<aabb, aabb> &b, const std::pair<aabb, aabb> &p)
+               {
+                   b.first.extend(p.first);
+                   b.second.extend(p.second);
+               });
+        const aabb &node_box = boxes.first, &centroid_box = boxes.second;
+        out[node_index].set_bounds(node_box);
+
+        if (n == 1 || depth >= SAH_MAX_DEPTH)
+        {
+            make_leaf(out[node_index], begin, end);
+            return;
+        }
+
+        double scale[3];
+        for (int a = 0; a < 3; ++a)
+        {
+            double extent = centroid_box.max[a] - centroid_box.min[a];
+            scale[a] = extent > 0 ? SAH_NUM_BINS / extent : 0;
+        }
+        node_bins bins;
+        reduce(begin, end, top, bins, [&](unsigned int first, unsigned int last, node_bins &nb)
+               {
+                   const double axis_scale[3] = {scale[0], scale[1], scale[2]};
+                   const double axis_min[3] = {centroid_box.min[0], centroid_box.min[1], centroid_box.min[2]};
+                   for (int a = 0; a < 3; ++a)
+                   {
+                       if (axis_scale[a] == 0)
+                           continue;
+                       for (unsigned int i = first; i < last; ++i)
+                       {
+                           unsigned int p = prim_indices[i];
+                           bin &b = nb.axes[a][bin_index(centroids[p][a], axis_min[a], axis_scale[a])];
+                           b.count++;
+                           b.box.extend((*bounds)[p]);
+                       }
+                   } },
+               [](node_bins &nb, const node_bins &p)
+               {
+                   for (int a = 0; a < 3; ++a)
+                   {
+                       for (int b = 0; b < SAH_NUM_BINS; ++b)
+                       {
+                           nb.axes[a][b].count += p.axes[a][b].count;
+                           nb.axes[a][b].box.extend(p.axes[a][b].box);
+                       }
+                   }
+               });
+
+        //find the cheapest bin boundary over all three axes
+        double best_cost = infinity;
+        int best_axis = -1, best_split = 0;
+        double inv_area = 1.0 / std::max(node_box.surface_area(), epsilon);
+        for (int a = 0; a < 3; ++a)
+        {
+            if (scale[a] == 0)
+                continue;
+            const bin *axis_bins = bins.axes[a];
+            //sweep from the right to get the cost of every right partition
+            double right_area[SAH_NUM_BINS - 1];
+            unsigned int right_count[SAH_NUM_BINS - 1];
+            aabb right_box;
+            unsigned int count = 0;
+            for (int b = SAH_NUM_BINS - 1; b > 0; --b)
+            {
+                right_box.extend(axis_bins[b].box);
+                count += axis_bins[b].count;
+                right_area[b - 1] = right_box.surface_area();
+                right_count[b - 1] = count;
+            }
+            aabb left_box;
+            count = 0;
+            for (int b = 0; b < SAH_NUM_BINS - 1; ++b)
+            {
+                left_box.extend(axis_bins[b].box);
+                count += axis_bins[b].count;
+                if (count == 0 || right_count[b] == 0)
+                    continue;
+                double cost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * inv_area *
+                                                       (left_box.surface_area() * count + right_area[b] * right_count[b]);
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = a;
+                    best_split = b;
+                }
+            }
+        }
+
+        unsigned int mid;
+        if (best_axis == -1)
+        {
+            //all centroids coincide, so no bin boundary separates them
+            if (n <= SAH_MAX_LEAF_SIZE)
+            {
+                make_leaf(out[node_index], begin, end);
+                return;
+            }
+            mid = begin + n / 2;
+        }
+        else
+        {
+            if (best_cost >= SAH_INTERSECTION_COST * n && n <= SAH_MAX_LEAF_SIZE)
+            {
+                make_leaf(out[node_index], begin, end);
+                return;
+            }
+            double axis_scale = scale[best_axis];
+            double axis_min = centroid_box.min[best_axis];
+            unsigned int *split = std::partition(prim_indices.data() + begin, prim_indices.data() + end,
+                                                 [&](unsigned int p)
+                                                 { return bin_index(centroids[p][best_axis], axis_min, axis_scale) <= best_split; });
+            mid = split - prim_indices.data();
+            if (mid == begin || mid == end)
+                mid = begin + n / 2;
+        }
+
+        unsigned int left_index = out.size();
+        out.push_back(sah_node());
+        build_node(out, left_index, begin, mid, depth + 1, top);
+        unsigned int right_index = out.size();
+        out.push_back(sah_node());
+        out[node_index].offset = right_index;
+        out[node_index].count = 0;
+        build_node(out, right_index, mid, end, depth + 1, top);
+    }
+
+    // builds the subtrees left by the top levels in parallel, then splices them into nodes
+    void build_subtrees()
+    {
+        if (subtrees.empty())
+            return;
+        std::vector<std::vector<sah_node>> subtree_nodes(subtrees.size());
+        pool->parallel_for(subtrees.size(), [&](unsigned int i)
+                           {
+                               const subtree &task = subtrees[i];
+                               subtree_nodes[i].reserve(2 * (task.end - task.begin));
+                               subtree_nodes[i].push_back(sah_node());
+                               build_node(subtree_nodes[i], 0, task.begin, task.end, task.depth, false); });
+        std::vector<int> subtree_at(nodes.size(), -1);
+        for (size_t i = 0; i < subtrees.size(); ++i)
+            subtree_at[subtrees[i].node_index] = i;
+        std::vector<sah_node> top;
+        top.swap(nodes);
+        size_t num_nodes = top.size();
+        for (const auto &subtree : subtree_nodes)
+            num_nodes += subtree.size();
+        nodes.reserve(num_nodes);
+        splice(top, subtree_at, subtree_nodes, 0);
+        subtrees.clear();
+    }
+
+    /**
+     * Appends top level node top_index and everything below it to nodes, depth first
+     * @return: index of the node in nodes
+    */
+    unsigned int splice(const std::vector<sah_node> &top, const std::vector<int> &subtree_at,
+                        std::vector<std::vector<sah_node>> &subtree_nodes, unsigned int top_index)
+    {
+        unsigned int index = nodes.size();
+        if (subtree_at[top_index] >= 0)
+        {
+            std::vector<sah_node> &subtree = subtree_nodes[subtree_at[top_index]];
+            for (sah_node node : subtree)
+            {
+                if (!node.is_leaf())
+                    node.offset += index; // right child index, local to the subtree
+                nodes.push_back(node);
+            }
+            std::vector<sah_node>().swap(subtree);
+            return index;
+        }
+        nodes.push_back(top[top_index]);
+        if (!top[top_index].is_leaf())
+        {
+            splice(top, subtree_at, subtree_nodes, top_index + 1);
+            unsigned int right_index = splice(top, subtree_at, subtree_nodes, top[top_index].offset);
+            nodes[index].offset = right_index;
+        }
+        return index;
+    }
+
+    static int bin_index(double centroid, double axis_min, double scale)
+    {
+        int b = static_cast<int>((centroid - axis_min) * scale);
+        return b < 0 ? 0 : (b >= SAH_NUM_BINS ? SAH_NUM_BINS - 1 : b);
+    }
+};
+
+/**
+ * Traversals of a flat sah bvh, shared by SAH_BVH and the mesh blas.
+ * Leaf callbacks receive the leaf's range [first, first + count) of the primitive order
+ * @return: number of nodes visited
+*/
+
+/**
+ * Front to back closest hit traversal on a fixed stack
+ * leaf(first, count) intersects the leaf and lowers closest_so_far on a closer hit
+*/
+template <typename leaf_function>
+unsigned long long sah_closest_hit(const std::vector<sah_node> &nodes, const ray &r, double t_min, double &closest_so_far, leaf_function leaf)
+{
+    if (nodes.empty())
+        return 0;
+    aabb_ray ar(r);
+    double tnear;
+    if (!nodes[0].hit(ar, t_min, closest_so_far, tnear))
+        return 0;
+
+    //children are pushed far first so the nearer one is always visited first
+    struct stack_entry
+    {
+        unsigned int node;
+        double t;
+    };
+    stack_entry stack[SAH_MAX_DEPTH + 2];
+    int stack_size = 0;
+    stack[stack_size++] = {0, tnear};
+    unsigned long long node_visits = 0;
+    while (stack_size)
+    {
+        stack_entry entry = stack[--stack_size];
+        if (entry.t > closest_so_far)
+            continue;
+        const sah_node &node = nodes[entry.node];
+        ++node_visits;
+        if (node.is_leaf())
+        {
+            leaf(node.offset, node.count);
+            continue;
+        }
+        unsigned int left = entry.node + 1, right = node.offset;
+        double t_left = 0, t_right = 0;
+        bool hit_left = nodes[left].hit(ar, t_min, closest_so_far, t_left);
+        bool hit_right = nodes[right].hit(ar, t_min, closest_so_far, t_right);
+        if (hit_left && hit_right)
+        {
+            if (t_left < t_right)
+            {
+                stack[stack_size++] = {right, t_right};
+                stack[stack_size++] = {left, t_left};
+            }
+            else
+            {
+                stack[stack_size++] = {left, t_left};
+                stack[stack_size++] = {right, t_right};
+            }
+        }
+        else if (hit_left)
+            stack[stack_size++] = {left, t_left};
+        else if (hit_right)
+            stack[stack_size++] = {right, t_right};
+    }
+    return node_visits;
+}
+
+/**
+ * Packet traversal, a node is entered while any lane still active in it hits its bounds
+ * leaf(first, count, mask) intersects the leaf for the lanes in mask and lowers their t_max
+*/
+template <typename leaf_function>
+unsigned long long sah_packet_hit(const std::vector<sah_node> &nodes, const ray_packet &packet, int active, double *t_max, leaf_function leaf)
+{
+    if (nodes.empty())
+        return 0;
+    struct packet_entry
+    {
+        unsigned int node;
+        int mask; // lanes that entered the node
+        double t; // nearest entry distance among them
+    };
+    packet_entry stack[SAH_MAX_DEPTH + 2];
+    int stack_size = 0;
+    unsigned long long node_visits = 0;
+    vdouble4 t_min(packet.t_min), tnear;
+    int root_mask = nodes[0].hit(packet.orig, packet.inv_dir, t_min, vdouble4::load(t_max), tnear) & active;
+    if (root_mask)
+        stack[stack_size++] = {0, root_mask, lane_min(tnear, root_mask)};
+    while (stack_size)
+    {
+        packet_entry entry = stack[--stack_size];
+        if (entry.t >= lane_max(t_max, entry.mask))
+            continue; //every lane already has a closer hit
+        const sah_node &node = nodes[entry.node];
+        ++node_visits;
+        if (node.is_leaf())
+        {
+            leaf(node.offset, node.count, entry.mask);
+            continue;
+        }
+        unsigned int left = entry.node + 1, right = node.offset;
+        vdouble4 t_max_lanes = vdouble4::load(t_max), tnear_left, tnear_right;
+        int left_mask = nodes[left].hit(packet.orig, packet.inv_dir, t_min, t_max_lanes, tnear_left) & entry.mask;
+        int right_mask = nodes[right].hit(packet.orig, packet.inv_dir, t_min, t_max_lanes, tnear_right) & entry.mask;
+        packet_entry near_entry = {left, left_mask, left_mask ? lane_min(tnear_left, left_mask) : 0};
+        packet_entry far_entry = {right, right_mask, right_mask ? lane_min(tnear_right, right_mask) : 0};
+        if (left_mask && right_mask && far_entry.t < near_entry.t)
+            std::swap(near_entry, far_entry);
+        if (far_entry.mask)
+            stack[stack_size++] = far_entry;
+        if (near_entry.mask)
+            stack[stack_size++] = near_entry;
+    }
+    return node_visits;
+}
+
+/**
+ * Any hit traversal, visiting order does not matter since the first occluder ends it
+ * leaf(first, count) returns true if something in the leaf occludes the ray
+*/
+template <typename leaf_function>
+bool sah_any_hit(const std::vector<sah_node> &nodes, const ray &r, interval ray_t, unsigned long long &node_visits, leaf_function leaf)
+{
+    if (nodes.empty())
+        return false;
+    aabb_ray ar(r);
+    double tnear;
+    unsigned int stack[SAH_MAX_DEPTH + 2];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size)
+    {
+        unsigned int node_index = stack[--stack_size];
+        const sah_node &node = nodes[node_index];
+        ++node_visits;
+        if (!node.hit(ar, ray_t.min, ray_t.max, tnear))
+            continue;
+        if (node.is_leaf())
+        {
+            if (leaf(node.offset, node.count))
+                return true;
+            continue;
+        }
+        stack[stack_size++] = node.offset;
+        stack[stack_size++] = node_index + 1;
+    }
+    return false;
+}
+
+/**
+ * TLAS alternative to the octree BVH: binary bvh built with binned sah.
+ * Better suited for clustered scenes or objects of very different sizes
+*/
+class SAH_BVH : public accel
+{
+private:
+    std::vector<sah_node> nodes;
+    std::vector<const hittable *> leaf_objects; // objects in leaf order, owned by objects
+
+public:
+    std::string name() const override { return "sah bvh"; }
+
+    void set_up_bvh() override
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        static const vec3 axes[3] = {vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1)};
+        std::vector<aabb> prim_bounds(objects.size());
+        //one task per object and axis, so a single large mesh still spreads over three threads
+        scheduler pool(build_threads);
+        pool.parallel_for(3 * objects.size(), [&](unsigned int task)
+                          {
+                              unsigned int i = task / 3, a = task % 3;
+                              objects[i]->compute_bounds(axes[a], prim_bounds[i].min[a], prim_bounds[i].max[a]); });
+        sah_builder builder;
+        builder.build(prim_bounds, build_threads);
+        nodes.swap(builder.nodes);
+        leaf_objects.resize(objects.size());
+        for (size_t i = 0; i < objects.size(); ++i)
+            leaf_objects[i] = objects[builder.prim_indices[i]].get();
+        auto stop = std::chrono::high_resolution_clock::now();
+        build_time_ms = std::chrono::duration<double, std::milli>(stop - start).count();
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        double closest_so_far = ray_t.max;
+        bool hit_anything = false;
+        hit_record temp_rec;
+        auto leaf = [&](unsigned int first, unsigned int count)
+        {
+            for (unsigned int i = first; i < first + count; ++i)
+            {
+                if (leaf_objects[i]->hit(r, interval(ray_t.min, closest_so_far), temp_rec))
+                {
+                    hit_anything = true;
+                    closest_so_far = temp_rec.t;
+                    rec = temp_rec;
+                }
+            }
+        };
+        record_traversal(sah_closest_hit(nodes, r, ray_t.min, closest_so_far, leaf));
+        return hit_anything;
+    }
+
+    int hit_packet(const ray_packet &packet, int active, double *t_max, hit_record *recs) const override
+    {
+        int hit_mask = 0;
+        auto leaf = [&](unsigned int first, unsigned int count, int mask)
+        {
+            for (unsigned int i = first; i < first + count; ++i)
+                hit_mask |= leaf_objects[i]->hit_packet(packet, mask, t_max, recs);
+        };
+        record_traversal(sah_packet_hit(nodes, packet, active, t_max, leaf), lane_count(active));
+        return hit_mask;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        auto leaf = [&](unsigned int first, unsigned int count)
+        {
+            for (unsigned int i = first; i < first + count; ++i)
+            {
+                if (leaf_objects[i]->occluded(r, ray_t))
+                    return true;
+            }
+            return false;
+        };
+        unsigned long long node_visits = 0;
+        bool hit_anything = sah_any_hit(nodes, r, ray_t, node_visits, leaf);
+        record_traversal(node_visits);
+        return hit_anything;
+    }
+};
+
+#endif
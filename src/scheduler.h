@@ -0,0 +1,121 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Work stealing scheduler for a fixed set of independent tasks.
+ * Tasks are dealt out in contiguous blocks to per worker deques. A worker pops from the back
+ * of its own deque and, once it runs dry, steals from the front of the others,
+ * so each deque lock is almost always taken by its owner only
+*/
+class scheduler
+{
+public:
+    // 0 threads means one per hardware thread
+    scheduler(unsigned int num_threads = 0)
+    {
+        if (num_threads == 0)
+            num_threads = std::thread::hardware_concurrency();
+        thread_count = std::max(1u, num_threads);
+    }
+
+    unsigned int threads() const { return thread_count; }
+
+    /**
+     * Runs task(index, worker) for every index in [0, num_tasks) and returns once all are done
+     * The calling thread takes part as worker 0
+    */
+    void run(unsigned int num_tasks, const std::function<void(unsigned int, unsigned int)> &task)
+    {
+        unsigned int num_workers = std::max(1u, std::min(thread_count, num_tasks));
+        std::vector<worker_queue> queues(num_workers);
+        for (unsigned int w = 0; w < num_workers; ++w)
+        {
+            //contiguous blocks keep neighbouring tiles on the same worker
+            unsigned int begin = static_cast<unsigned long long>(num_tasks) * w / num_workers;
+            unsigned int end = static_cast<unsigned long long>(num_tasks) * (w + 1) / num_workers;
+            for (unsigned int i = end; i > begin; --i)
+                queues[w].tasks.push_back(i - 1); //popped from the back, so in increasing order
+        }
+        std::vector<std::thread> workers;
+        for (unsigned int w = 1; w < num_workers; ++w)
+            workers.push_back(std::thread(&scheduler::work, std::ref(queues), w, std::cref(task)));
+        work(queues, 0, task);
+        for (auto &th : workers)
+            th.join();
+    }
+
+    // body(i) for every i in [0, n)
+    void parallel_for(unsigned int n, const std::function<void(unsigned int)> &body)
+    {
+        run(n, [&](unsigned int i, unsigned int)
+            { body(i); });
+    }
+
+    // number of blocks to split n indices into: a few per thread, of at least min_block indices each
+    unsigned int blocks(size_t n, size_t min_block) const
+    {
+        if (thread_count == 1)
+            return 1;
+        return static_cast<unsigned int>(std::max<size_t>(1, std::min<size_t>(thread_count * 4, n / min_block)));
+    }
+
+    // body(begin, end, block) for each of num_blocks contiguous blocks of [0, n)
+    void parallel_blocks(size_t n, unsigned int num_blocks, const std::function<void(size_t, size_t, unsigned int)> &body)
+    {
+        parallel_for(num_blocks, [&](unsigned int b)
+                     { body(n * b / num_blocks, n * (b + 1) / num_blocks, b); });
+    }
+
+private:
+    unsigned int thread_count;
+
+    struct worker_queue
+    {
+        std::mutex mutex;
+        std::deque<unsigned int> tasks;
+    };
+
+    static void work(std::vector<worker_queue> &queues, unsigned int worker,
+                     const std::function<void(unsigned int, unsigned int)> &task)
+    {
+        unsigned int index;
+        while (pop(queues[worker], index) || steal(queues, worker, index))
+            task(index, worker);
+    }
+
+    static bool pop(worker_queue &queue, unsigned int &index)
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            return false;
+        index = queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    // tasks are never added while running, so one empty sweep over all victims means no work is left
+    static bool steal(std::vector<worker_queue> &queues, unsigned int thief, unsigned int &index)
+    {
+        for (size_t k = 1; k < queues.size(); ++k)
+        {
+            worker_queue &victim = queues[(thief + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                index = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+#endif
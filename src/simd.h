@@ -0,0 +1,422 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+/**
+ * 4 wide double lanes used by the packet and slab kernels, and 4 wide float lanes used by the triangle kernels.
+ * Backend is chosen at build time: AVX when compiled with -mavx (or -march=native on an AVX machine),
+ * otherwise a pair of SSE2 registers, otherwise plain scalar code (also forced with -DDISABLE_SIMD).
+ * Comparisons return lane masks (all bits set per true lane) to be combined with & | andnot and select
+*/
+
+#include <cmath>
+
+#if !defined(DISABLE_SIMD) && defined(__AVX__)
+#define SIMD_AVX 1
+#include <immintrin.h>
+#elif !defined(DISABLE_SIMD) && defined(__SSE2__)
+#define SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if SIMD_AVX || SIMD_SSE2
+#define SIMD_VECTORIZED 1
+#endif
+
+#define SIMD_WIDTH 4
+
+struct vdouble4
+{
+#if SIMD_AVX
+    __m256d v;
+    vdouble4() {}
+    vdouble4(__m256d x) : v(x) {}
+    vdouble4(double x) : v(_mm256_set1_pd(x)) {}
+    vdouble4(double a, double b, double c, double d) : v(_mm256_setr_pd(a, b, c, d)) {}
+    static vdouble4 load(const double *p) { return _mm256_loadu_pd(p); }
+    static vdouble4 load(const float *p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+    void store(double *p) const { _mm256_storeu_pd(p, v); }
+#elif SIMD_SSE2
+    __m128d lo, hi;
+    vdouble4() {}
+    vdouble4(__m128d l, __m128d h) : lo(l), hi(h) {}
+    vdouble4(double x) : lo(_mm_set1_pd(x)), hi(_mm_set1_pd(x)) {}
+    vdouble4(double a, double b, double c, double d) : lo(_mm_setr_pd(a, b)), hi(_mm_setr_pd(c, d)) {}
+    static vdouble4 load(const double *p) { return vdouble4(_mm_loadu_pd(p), _mm_loadu_pd(p + 2)); }
+    static vdouble4 load(const float *p)
+    {
+        __m128 f = _mm_loadu_ps(p);
+        return vdouble4(_mm_cvtps_pd(f), _mm_cvtps_pd(_mm_movehl_ps(f, f)));
+    }
+    void store(double *p) const
+    {
+        _mm_storeu_pd(p, lo);
+        _mm_storeu_pd(p + 2, hi);
+    }
+#else
+    double e[4];
+    vdouble4() {}
+    vdouble4(double x) : e{x, x, x, x} {}
+    vdouble4(double a, double b, double c, double d) : e{a, b, c, d} {}
+    static vdouble4 load(const double *p) { return vdouble4(p[0], p[1], p[2], p[3]); }
+    static vdouble4 load(const float *p) { return vdouble4(p[0], p[1], p[2], p[3]); }
+    void store(double *p) const
+    {
+        for (int i = 0; i < 4; ++i)
+            p[i] = e[i];
+    }
+#endif
+
+    double operator[](int i) const
+    {
+        double lanes[4];
+        store(lanes);
+        return lanes[i];
+    }
+};
+
+#if SIMD_AVX
+#define VDOUBLE4_BINARY(op, intrinsic) \
+    inline vdouble4 op(const vdouble4 &a, const vdouble4 &b) { return intrinsic(a.v, b.v); }
+#define VDOUBLE4_COMPARE(op, predicate) \
+    inline vdouble4 op(const vdouble4 &a, const vdouble4 &b) { return _mm256_cmp_pd(a.v, b.v, predicate); }
+
+VDOUBLE4_BINARY(operator+, _mm256_add_pd)
+VDOUBLE4_BINARY(operator-, _mm256_sub_pd)
+VDOUBLE4_BINARY(operator*, _mm256_mul_pd)
+VDOUBLE4_BINARY(operator/, _mm256_div_pd)
+VDOUBLE4_BINARY(operator&, _mm256_and_pd)
+VDOUBLE4_BINARY(operator|, _mm256_or_pd)
+VDOUBLE4_BINARY(min, _mm256_min_pd)
+VDOUBLE4_BINARY(max, _mm256_max_pd)
+VDOUBLE4_COMPARE(operator<, _CMP_LT_OQ)
+VDOUBLE4_COMPARE(operator<=, _CMP_LE_OQ)
+VDOUBLE4_COMPARE(operator>, _CMP_GT_OQ)
+VDOUBLE4_COMPARE(operator>=, _CMP_GE_OQ)
+
+// a & ~mask
+inline vdouble4 andnot(const vdouble4 &mask, const vdouble4 &a) { return _mm256_andnot_pd(mask.v, a.v); }
+inline vdouble4 sqrt(const vdouble4 &a) { return _mm256_sqrt_pd(a.v); }
+// mask ? a : b per lane
+inline vdouble4 select(const vdouble4 &mask, const vdouble4 &a, const vdouble4 &b) { return _mm256_blendv_pd(b.v, a.v, mask.v); }
+// bit i set when lane i of mask is true
+inline int movemask(const vdouble4 &mask) { return _mm256_movemask_pd(mask.v); }
+// largest and smallest lane
+inline double hmax(const vdouble4 &a)
+{
+    __m128d m = _mm_max_pd(_mm256_castpd256_pd128(a.v), _mm256_extractf128_pd(a.v, 1));
+    return _mm_cvtsd_f64(_mm_max_sd(m, _mm_unpackhi_pd(m, m)));
+}
+inline double hmin(const vdouble4 &a)
+{
+    __m128d m = _mm_min_pd(_mm256_castpd256_pd128(a.v), _mm256_extractf128_pd(a.v, 1));
+    return _mm_cvtsd_f64(_mm_min_sd(m, _mm_unpackhi_pd(m, m)));
+}
+
+#elif SIMD_SSE2
+#define VDOUBLE4_BINARY(op, intrinsic) \
+    inline vdouble4 op(const vdouble4 &a, const vdouble4 &b) { return vdouble4(intrinsic(a.lo, b.lo), intrinsic(a.hi, b.hi)); }
+#define VDOUBLE4_COMPARE(op, intrinsic) VDOUBLE4_BINARY(op, intrinsic)
+
+VDOUBLE4_BINARY(operator+, _mm_add_pd)
+VDOUBLE4_BINARY(operator-, _mm_sub_pd)
+VDOUBLE4_BINARY(operator*, _mm_mul_pd)
+VDOUBLE4_BINARY(operator/, _mm_div_pd)
+VDOUBLE4_BINARY(operator&, _mm_and_pd)
+VDOUBLE4_BINARY(operator|, _mm_or_pd)
+VDOUBLE4_BINARY(min, _mm_min_pd)
+VDOUBLE4_BINARY(max, _mm_max_pd)
+VDOUBLE4_COMPARE(operator<, _mm_cmplt_pd)
+VDOUBLE4_COMPARE(operator<=, _mm_cmple_pd)
+VDOUBLE4_COMPARE(operator>, _mm_cmpgt_pd)
+VDOUBLE4_COMPARE(operator>=, _mm_cmpge_pd)
+
+// a & ~mask
+inline vdouble4 andnot(const vdouble4 &mask, const vdouble4 &a) { return vdouble4(_mm_andnot_pd(mask.lo, a.lo), _mm_andnot_pd(mask.hi, a.hi)); }
+inline vdouble4 sqrt(const vdouble4 &a) { return vdouble4(_mm_sqrt_pd(a.lo), _mm_sqrt_pd(a.hi)); }
+// mask ? a : b per lane
+inline vdouble4 select(const vdouble4 &mask, const vdouble4 &a, const vdouble4 &b) { return (mask & a) | andnot(mask, b); }
+// bit i set when lane i of mask is true
+inline int movemask(const vdouble4 &mask) { return _mm_movemask_pd(mask.lo) | (_mm_movemask_pd(mask.hi) << 2); }
+// largest and smallest lane
+inline double hmax(const vdouble4 &a)
+{
+    __m128d m = _mm_max_pd(a.lo, a.hi);
+    return _mm_cvtsd_f64(_mm_max_sd(m, _mm_unpackhi_pd(m, m)));
+}
+inline double hmin(const vdouble4 &a)
+{
+    __m128d m = _mm_min_pd(a.lo, a.hi);
+    return _mm_cvtsd_f64(_mm_min_sd(m, _mm_unpackhi_pd(m, m)));
+}
+
+#else
+#include <cstdint>
+#include <cstring>
+
+inline double lane_bits(uint64_t bits)
+{
+    double d;
+    std::memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+inline uint64_t lane_bits(double d)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &d, sizeof(d));
+    return bits;
+}
+
+#define VDOUBLE4_BINARY(op, expr)                               \
+    inline vdouble4 op(const vdouble4 &a, const vdouble4 &b)    \
+    {                                                           \
+        vdouble4 r;                                             \
+        for (int i = 0; i < 4; ++i)                             \
+        {                                                       \
+            double x = a.e[i], y = b.e[i];                      \
+            r.e[i] = (expr);                                    \
+        }                                                       \
+        return r;                                               \
+    }
+#define VDOUBLE4_COMPARE(op, expr) VDOUBLE4_BINARY(op, lane_bits((expr) ? ~uint64_t(0) : uint64_t(0)))
+
+VDOUBLE4_BINARY(operator+, x + y)
+VDOUBLE4_BINARY(operator-, x - y)
+VDOUBLE4_BINARY(operator*, x *y)
+VDOUBLE4_BINARY(operator/, x / y)
+VDOUBLE4_BINARY(operator&, lane_bits(lane_bits(x) & lane_bits(y)))
+VDOUBLE4_BINARY(operator|, lane_bits(lane_bits(x) | lane_bits(y)))
+VDOUBLE4_BINARY(min, x < y ? x : y)
+VDOUBLE4_BINARY(max, x > y ? x : y)
+VDOUBLE4_COMPARE(operator<, x < y)
+VDOUBLE4_COMPARE(operator<=, x <= y)
+VDOUBLE4_COMPARE(operator>, x > y)
+VDOUBLE4_COMPARE(operator>=, x >= y)
+
+// a & ~mask
+VDOUBLE4_BINARY(andnot, lane_bits(~lane_bits(x) & lane_bits(y)))
+inline vdouble4 sqrt(const vdouble4 &a) { return vdouble4(std::sqrt(a.e[0]), std::sqrt(a.e[1]), std::sqrt(a.e[2]), std::sqrt(a.e[3])); }
+// mask ? a : b per lane
+inline vdouble4 select(const vdouble4 &mask, const vdouble4 &a, const vdouble4 &b) { return (mask & a) | andnot(mask, b); }
+// bit i set when lane i of mask is true
+inline int movemask(const vdouble4 &mask)
+{
+    int bits = 0;
+    for (int i = 0; i < 4; ++i)
+        bits |= static_cast<int>(lane_bits(mask.e[i]) >> 63) << i;
+    return bits;
+}
+// largest and smallest lane
+inline double hmax(const vdouble4 &a) { return std::fmax(std::fmax(a.e[0], a.e[1]), std::fmax(a.e[2], a.e[3])); }
+inline double hmin(const vdouble4 &a) { return std::fmin(std::fmin(a.e[0], a.e[1]), std::fmin(a.e[2], a.e[3])); }
+#endif
+
+#undef VDOUBLE4_BINARY
+#undef VDOUBLE4_COMPARE
+
+inline vdouble4 operator-(const vdouble4 &a) { return vdouble4(0.0) - a; }
+inline vdouble4 abs(const vdouble4 &a) { return max(a, -a); }
+
+/**
+ * Turns lanes (x, y, z, w) into (y, z, x, w), used by the simd vec3 cross product
+*/
+#if SIMD_AVX
+inline vdouble4 rotate3(const vdouble4 &a)
+{
+#ifdef __AVX2__
+    return _mm256_permute4x64_pd(a.v, _MM_SHUFFLE(3, 0, 2, 1));
+#else
+    __m128d lo = _mm256_castpd256_pd128(a.v), hi = _mm256_extractf128_pd(a.v, 1);
+    return _mm256_insertf128_pd(_mm256_castpd128_pd256(_mm_shuffle_pd(lo, hi, 1)), _mm_shuffle_pd(lo, hi, 2), 1);
+#endif
+}
+#elif SIMD_SSE2
+inline vdouble4 rotate3(const vdouble4 &a) { return vdouble4(_mm_shuffle_pd(a.lo, a.hi, 1), _mm_shuffle_pd(a.lo, a.hi, 2)); }
+#else
+inline vdouble4 rotate3(const vdouble4 &a) { return vdouble4(a.e[1], a.e[2], a.e[0], a.e[3]); }
+#endif
+
+struct vfloat4
+{
+#if SIMD_VECTORIZED
+    __m128 v;
+    vfloat4() {}
+    vfloat4(__m128 x) : v(x) {}
+    vfloat4(float x) : v(_mm_set1_ps(x)) {}
+    vfloat4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+    static vfloat4 load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+    void store(double *p) const
+    {
+        _mm_storeu_pd(p, _mm_cvtps_pd(v));
+        _mm_storeu_pd(p + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+#else
+    float e[4];
+    vfloat4() {}
+    vfloat4(float x) : e{x, x, x, x} {}
+    vfloat4(float a, float b, float c, float d) : e{a, b, c, d} {}
+    static vfloat4 load(const float *p) { return vfloat4(p[0], p[1], p[2], p[3]); }
+    void store(float *p) const
+    {
+        for (int i = 0; i < 4; ++i)
+            p[i] = e[i];
+    }
+    void store(double *p) const
+    {
+        for (int i = 0; i < 4; ++i)
+            p[i] = e[i];
+    }
+#endif
+};
+
+#if SIMD_VECTORIZED
+#define VFLOAT4_BINARY(op, intrinsic) \
+    inline vfloat4 op(const vfloat4 &a, const vfloat4 &b) { return intrinsic(a.v, b.v); }
+
+VFLOAT4_BINARY(operator+, _mm_add_ps)
+VFLOAT4_BINARY(operator-, _mm_sub_ps)
+VFLOAT4_BINARY(operator*, _mm_mul_ps)
+VFLOAT4_BINARY(operator/, _mm_div_ps)
+VFLOAT4_BINARY(operator&, _mm_and_ps)
+VFLOAT4_BINARY(operator|, _mm_or_ps)
+VFLOAT4_BINARY(min, _mm_min_ps)
+VFLOAT4_BINARY(max, _mm_max_ps)
+VFLOAT4_BINARY(operator<, _mm_cmplt_ps)
+VFLOAT4_BINARY(operator<=, _mm_cmple_ps)
+VFLOAT4_BINARY(operator>, _mm_cmpgt_ps)
+VFLOAT4_BINARY(operator>=, _mm_cmpge_ps)
+
+// a & ~mask
+inline vfloat4 andnot(const vfloat4 &mask, const vfloat4 &a) { return _mm_andnot_ps(mask.v, a.v); }
+// mask ? a : b per lane
+inline vfloat4 select(const vfloat4 &mask, const vfloat4 &a, const vfloat4 &b) { return (mask & a) | andnot(mask, b); }
+// bit i set when lane i of mask is true
+inline int movemask(const vfloat4 &mask) { return _mm_movemask_ps(mask.v); }
+
+#else
+inline float lane_bits(uint32_t bits)
+{
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+inline uint32_t lane_bits(float f)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(f));
+    return bits;
+}
+
+#define VFLOAT4_BINARY(op, expr)                              \
+    inline vfloat4 op(const vfloat4 &a, const vfloat4 &b)     \
+    {                                                         \
+        vfloat4 r;                                            \
+        for (int i = 0; i < 4; ++i)                           \
+        {                                                     \
+            float x = a.e[i], y = b.e[i];                     \
+            r.e[i] = (expr);                                  \
+        }                                                     \
+        return r;                                             \
+    }
+#define VFLOAT4_COMPARE(op, expr) VFLOAT4_BINARY(op, lane_bits((expr) ? ~uint32_t(0) : uint32_t(0)))
+
+VFLOAT4_BINARY(operator+, x + y)
+VFLOAT4_BINARY(operator-, x - y)
+VFLOAT4_BINARY(operator*, x *y)
+VFLOAT4_BINARY(operator/, x / y)
+VFLOAT4_BINARY(operator&, lane_bits(lane_bits(x) & lane_bits(y)))
+VFLOAT4_BINARY(operator|, lane_bits(lane_bits(x) | lane_bits(y)))
+VFLOAT4_BINARY(min, x < y ? x : y)
+VFLOAT4_BINARY(max, x > y ? x : y)
+VFLOAT4_COMPARE(operator<, x < y)
+VFLOAT4_COMPARE(operator<=, x <= y)
+VFLOAT4_COMPARE(operator>, x > y)
+VFLOAT4_COMPARE(operator>=, x >= y)
+
+// a & ~mask
+VFLOAT4_BINARY(andnot, lane_bits(~lane_bits(x) & lane_bits(y)))
+// mask ? a : b per lane
+inline vfloat4 select(const vfloat4 &mask, const vfloat4 &a, const vfloat4 &b) { return (mask & a) | andnot(mask, b); }
+// bit i set when lane i of mask is true
+inline int movemask(const vfloat4 &mask)
+{
+    int bits = 0;
+    for (int i = 0; i < 4; ++i)
+        bits |= static_cast<int>(lane_bits(mask.e[i]) >> 31) << i;
+    return bits;
+}
+#undef VFLOAT4_COMPARE
+#endif
+
+#undef VFLOAT4_BINARY
+
+inline vfloat4 operator-(const vfloat4 &a) { return vfloat4(0.0f) - a; }
+inline vfloat4 abs(const vfloat4 &a) { return max(a, -a); }
+
+/**
+ * Lanes the triangle kernels compute in: double, or float when compiled with -DFLOAT_GEOMETRY.
+ * Triangles are stored in float either way, hit distances and everything after the hit stay double
+*/
+#if FLOAT_GEOMETRY
+typedef vfloat4 vgeometry4;
+#else
+typedef vdouble4 vgeometry4;
+#endif
+
+/**
+ * a * b rounded on its own: the empty asm hides the product from the optimizer, so it is never fused with a
+ * following add or subtract into an FMA. Kernels that must compute every lane the same way whatever code
+ * they are inlined into use it, -ffp-contract would only apply to whole functions after inlining
+*/
+inline vdouble4 mul_unfused(const vdouble4 &a, const vdouble4 &b)
+{
+    vdouble4 p = a * b;
+#if defined(__GNUC__) && SIMD_AVX
+    asm("" : "+x"(p.v));
+#elif defined(__GNUC__) && SIMD_SSE2
+    asm("" : "+x"(p.lo), "+x"(p.hi));
+#elif defined(__GNUC__)
+    asm("" : "+m"(p.e));
+#endif
+    return p;
+}
+
+inline vfloat4 mul_unfused(const vfloat4 &a, const vfloat4 &b)
+{
+    vfloat4 p = a * b;
+#if defined(__GNUC__) && SIMD_VECTORIZED
+    asm("" : "+x"(p.v));
+#elif defined(__GNUC__)
+    asm("" : "+m"(p.e));
+#endif
+    return p;
+}
+
+// exact widening of float lanes
+inline vdouble4 to_vdouble4(const vfloat4 &a)
+{
+#if SIMD_AVX
+    return _mm256_cvtps_pd(a.v);
+#elif SIMD_SSE2
+    return vdouble4(_mm_cvtps_pd(a.v), _mm_cvtps_pd(_mm_movehl_ps(a.v, a.v)));
+#else
+    return vdouble4(a.e[0], a.e[1], a.e[2], a.e[3]);
+#endif
+}
+inline vdouble4 to_vdouble4(const vdouble4 &a) { return a; }
+
+// rounding of double lanes to the lanes of the triangle kernels
+inline vgeometry4 to_vgeometry4(const vdouble4 &a)
+{
+#if !FLOAT_GEOMETRY
+    return a;
+#elif SIMD_AVX
+    return _mm256_cvtpd_ps(a.v);
+#elif SIMD_SSE2
+    return _mm_movelh_ps(_mm_cvtpd_ps(a.lo), _mm_cvtpd_ps(a.hi));
+#else
+    return vfloat4(a.e[0], a.e[1], a.e[2], a.e[3]);
+#endif
+}
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "hittable.h"
 #include "interval.h"
+#include "material.h"
+#include "material_table.h"
 #include "vec3.h"
 
 class sphere : public hittable
@@ -11,6 +13,7 @@ private:
     point3 center;
     double radius;
     shared_ptr<material> mat;
+    int material_id = -1;
 
 public:
     sphere(point3 _center, double _radius, shared_ptr<material> _material)
@@ -44,13 +47,119 @@ public:
                 return false;
         }
 
+        fill_record(r, root, rec);
+        return true;
+    }
+
+    int hit_packet(const ray_packet &packet, int active, double *t_max, hit_record *recs) const override
+    {
+        vdouble4 ocx = packet.orig[0] - center.x();
+        vdouble4 ocy = packet.orig[1] - center.y();
+        vdouble4 ocz = packet.orig[2] - center.z();
+        vdouble4 a = packet.dir[0] * packet.dir[0] + packet.dir[1] * packet.dir[1] + packet.dir[2] * packet.dir[2];
+        vdouble4 half_b = ocx * packet.dir[0] + ocy * packet.dir[1] + ocz * packet.dir[2];
+        vdouble4 c = ocx * ocx + ocy * ocy + ocz * ocz - radius * radius;
+        vdouble4 discriminant = half_b * half_b - a * c;
+        vdouble4 sqrtd = sqrt(max(discriminant, 0.0));
+
+        // same root selection as hit, for all lanes at once
+        vdouble4 t_min(packet.t_min), t_max_lanes = vdouble4::load(t_max);
+        vdouble4 root_near = (-half_b - sqrtd) / a;
+        vdouble4 root_far = (-half_b + sqrtd) / a;
+        vdouble4 near_ok = (root_near > t_min) & (root_near < t_max_lanes);
+        vdouble4 far_ok = (root_far > t_min) & (root_far < t_max_lanes);
+        int hit_mask = movemask((discriminant >= 0.0) & (near_ok | far_ok)) & active;
+        if (!hit_mask)
+            return 0;
+        double roots[PACKET_SIZE];
+        select(near_ok, root_near, root_far).store(roots);
+        for (int i = 0; i < PACKET_SIZE; ++i)
+        {
+            if ((hit_mask >> i) & 1)
+            {
+                fill_record(packet.rays[i], roots[i], recs[i]);
+                t_max[i] = roots[i];
+            }
+        }
+        return hit_mask;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        vec3 oc = r.origin() - center;
+        double a = r.direction().length_squared();
+        double half_b = dot(oc, r.direction());
+        double c = oc.length_squared() - radius * radius;
+
+        double discriminant = half_b * half_b - a * c;
+        if (discriminant < 0)
+            return false;
+        double sqrtd = sqrt(discriminant);
+        return ray_t.surrounds((-half_b - sqrtd) / a) || ray_t.surrounds((-half_b + sqrtd) / a);
+    }
+
+    void register_materials(material_table &table) override
+    {
+        material_id = table.add(mat);
+    }
+
+    bool is_emissive() const override
+    {
+        return mat->emit_light().length_squared() > 0;
+    }
+
+    /**
+     * Uniformly samples the cone of directions from origin that hit the sphere
+    */
+    bool sample_light(const point3 &origin, sampler &rng, light_sample &sample) const override
+    {
+        double width = cone_width(origin);
+        if (width <= 0)
+            return false;
+        // 1 - cos_theta is uniform in [0, width]
+        double one_minus_cos = random_double(rng) * width;
+        double sin_theta = sqrt(one_minus_cos * (2 - one_minus_cos));
+        double phi = 2 * pi * random_double(rng);
+        sample.direction = from_local(unit_vector(center - origin), cos(phi) * sin_theta, sin(phi) * sin_theta, 1 - one_minus_cos);
+
+        // distance to the near side along the sampled direction
+        vec3 oc = origin - center;
+        double half_b = dot(oc, sample.direction);
+        double c = oc.length_squared() - radius * radius;
+        sample.distance = -half_b - sqrt(fmax(0.0, half_b * half_b - c));
+        sample.pdf = 1 / (2 * pi * width);
+        sample.emitted = mat->emit_light();
+        return true;
+    }
+
+    double light_pdf(const point3 &origin, const hit_record &rec) const override
+    {
+        (void)rec;
+        double width = cone_width(origin);
+        return width > 0 ? 1 / (2 * pi * width) : 0;
+    }
+
+private:
+    void fill_record(const ray &r, double root, hit_record &rec) const
+    {
         rec.t = root;                           //hits at time t
         rec.p = r.at(rec.t);                    //at point p
         rec.normal = (rec.p - center) / radius; //calculate normal vector of surface
-        rec.mat = mat;
+        rec.material_id = material_id;
+        rec.object = this;
         rec.set_face_normal(r, rec.normal);
+    }
 
-        return true;
+    /**
+     * 1 - cos of the half angle of the cone of directions from origin to the sphere, its solid angle is 2 pi times that
+     * Written to stay accurate for small or distant spheres, 0 from inside
+    */
+    double cone_width(const point3 &origin) const
+    {
+        double sin_squared = radius * radius / (center - origin).length_squared();
+        if (sin_squared >= 1)
+            return 0;
+        return sin_squared / (1 + sqrt(1 - sin_squared));
     }
 };
 #endif
\ No newline at end of file
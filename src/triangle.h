@@ -3,8 +3,34 @@
 
 #include "hittable.h"
 #include "interval.h"
+#include "material.h"
+#include "material_table.h"
 #include "vec3.h"
 
+/**
+ * Uniformly distributed point of the triangle v0, v0 + edge1, v0 + edge2
+*/
+inline point3 random_in_triangle(const point3 &v0, const vec3 &edge1, const vec3 &edge2, sampler &rng)
+{
+    double s = sqrt(random_double(rng));
+    double t = random_double(rng);
+    return v0 + s * (1 - t) * edge1 + s * t * edge2;
+}
+
+/**
+ * Solid angle density of a point p of an emitter sampled uniformly by area, seen from origin
+ * @return: 0 if p is seen edge on
+*/
+inline double area_light_pdf(const point3 &origin, const point3 &p, const vec3 &unit_normal, double area)
+{
+    vec3 to_point = p - origin;
+    double distance_squared = to_point.length_squared();
+    double cosine = fabs(dot(unit_normal, to_point)) / sqrt(distance_squared);
+    if (cosine < 1e-8)
+        return 0;
+    return distance_squared / (cosine * area);
+}
+
 class triangle : public hittable
 {
 private:
@@ -12,15 +38,134 @@ private:
     point3 v1;
     point3 v2;
     shared_ptr<material> mat;
+    int material_id = -1;
 
 public:
     triangle(point3 v0, point3 v1, point3 v2, shared_ptr<material> material)
         : v0(v0), v1(v1), v2(v2), mat(material) {}
 
+    void compute_bounds(vec3 normal, double &dnear, double &dfar) override
+    {
+        const point3 *verts[3] = {&v0, &v1, &v2};
+        double vec_dot;
+        for (size_t i = 0; i < 3; ++i)
+        {
+            vec_dot = dot(normal, *verts[i]);
+            if (vec_dot < dnear)
+                dnear = vec_dot;
+            if (vec_dot > dfar)
+                dfar = vec_dot;
+        }
+    }
+
     /**
      * Implementation of MT algorithm
     */
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        double t;
+        if (!intersect(r, ray_t, t))
+            return false;
+        fill_record(r, t, rec);
+        return true;
+    }
+
+    /**
+     * MT algorithm on all lanes of the packet at once
+    */
+    int hit_packet(const ray_packet &packet, int active, double *t_max, hit_record *recs) const override
+    {
+        vec3 v01 = v1 - v0;
+        vec3 v02 = v2 - v0;
+        const vdouble4 *dir = packet.dir;
+        // pvec = cross(dir, v02)
+        vdouble4 px = dir[1] * v02.z() - dir[2] * v02.y();
+        vdouble4 py = dir[2] * v02.x() - dir[0] * v02.z();
+        vdouble4 pz = dir[0] * v02.y() - dir[1] * v02.x();
+        vdouble4 determinant = px * v01.x() + py * v01.y() + pz * v01.z();
+        vdouble4 valid = abs(determinant) >= epsilon;
+        vdouble4 inverse_determinant = vdouble4(1.0) / determinant;
+
+        vdouble4 tx = packet.orig[0] - v0.x(), ty = packet.orig[1] - v0.y(), tz = packet.orig[2] - v0.z();
+        vdouble4 u = (tx * px + ty * py + tz * pz) * inverse_determinant;
+        valid = valid & (u >= 0.0) & (u <= 1.0);
+
+        // qvec = cross(tvec, v01)
+        vdouble4 qx = ty * v01.z() - tz * v01.y();
+        vdouble4 qy = tz * v01.x() - tx * v01.z();
+        vdouble4 qz = tx * v01.y() - ty * v01.x();
+        vdouble4 v = (dir[0] * qx + dir[1] * qy + dir[2] * qz) * inverse_determinant;
+        valid = valid & (v >= 0.0) & (u + v <= 1.0);
+        vdouble4 t = (qx * v02.x() + qy * v02.y() + qz * v02.z()) * inverse_determinant;
+        valid = valid & (t > packet.t_min) & (t < vdouble4::load(t_max));
+
+        int hit_mask = movemask(valid) & active;
+        if (!hit_mask)
+            return 0;
+        double ts[PACKET_SIZE];
+        t.store(ts);
+        for (int i = 0; i < PACKET_SIZE; ++i)
+        {
+            if ((hit_mask >> i) & 1)
+            {
+                fill_record(packet.rays[i], ts[i], recs[i]);
+                t_max[i] = ts[i];
+            }
+        }
+        return hit_mask;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        double t;
+        return intersect(r, ray_t, t);
+    }
+
+    void register_materials(material_table &table) override
+    {
+        material_id = table.add(mat);
+    }
+
+    bool is_emissive() const override
+    {
+        return mat->emit_light().length_squared() > 0;
+    }
+
+    // uniform by area
+    bool sample_light(const point3 &origin, sampler &rng, light_sample &sample) const override
+    {
+        point3 p = random_in_triangle(v0, v1 - v0, v2 - v0, rng);
+        sample.pdf = area_light_pdf(origin, p, unit_vector(cross(v1 - v0, v2 - v0)), area());
+        if (sample.pdf <= 0)
+            return false;
+        sample.distance = (p - origin).length();
+        sample.direction = (p - origin) / sample.distance;
+        sample.emitted = mat->emit_light();
+        return true;
+    }
+
+    double light_pdf(const point3 &origin, const hit_record &rec) const override
+    {
+        return area_light_pdf(origin, rec.p, rec.normal, area());
+    }
+
+private:
+    double area() const
+    {
+        return 0.5 * cross(v1 - v0, v2 - v0).length();
+    }
+
+    void fill_record(const ray &r, double t, hit_record &rec) const
+    {
+        rec.t = t;
+        rec.p = r.at(rec.t);
+        rec.normal = unit_vector(cross(v1 - v0, v2 - v0));
+        rec.material_id = material_id;
+        rec.object = this;
+        rec.set_face_normal(r, rec.normal);
+    }
+
+    bool intersect(const ray &r, interval ray_t, double &t) const
     {
         vec3 v01 = v1 - v0;
         vec3 v02 = v2 - v0;
@@ -39,13 +184,8 @@ public:
         vec3 qvec = cross(tvec, v01);
         double v = dot(r.direction(), qvec)*inverse_determinant;
         if(v < 0 || u+v > 1) return false;
-        rec.t = dot(v02, qvec)*inverse_determinant;
-        if (!ray_t.surrounds(rec.t)) return false;
-        rec.p = r.at(rec.t);
-        rec.normal = unit_vector(cross(v01, v02));
-        rec.mat = mat;
-        rec.set_face_normal(r, rec.normal);
-        return true;
+        t = dot(v02, qvec)*inverse_determinant;
+        return ray_t.surrounds(t);
     }
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,244 @@
+#ifndef TRIANGLE_STORE_H
+#define TRIANGLE_STORE_H
+
+#include "ray.h"
+#include "simd.h"
+#include "utilities.h"
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#define TRIANGLE_STORE_PADDING (SIMD_WIDTH - 1)
+
+/**
+ * Structure of arrays triangle storage owned by a mesh.
+ * Keeps the three vertices and the unit face normal in float, so intersecting needs no per triangle object,
+ * virtual call or cross product. Vertices are stored rather than edges: triangles sharing an edge then
+ * see exactly the same edge, which the watertight test needs to leave no cracks between them.
+ * Leaves start at any triangle, so the arrays end with TRIANGLE_STORE_PADDING degenerate triangles
+ * and SIMD_WIDTH consecutive triangles can be loaded from any of them
+*/
+class triangle_store
+{
+    friend class mesh_cache;
+
+public:
+    std::vector<float> v0[3];
+    std::vector<float> v1[3];
+    std::vector<float> v2[3];
+    std::vector<float> normal[3];
+
+    /**
+     * Ray set up for the watertight test (Woop et al. 2013), computed once per ray:
+     * axes are permuted so that kz is the largest direction component, and the shear
+     * maps the direction onto +z, so the test reduces to 2D edge functions around the origin
+    */
+    struct ray_lanes
+    {
+        int kx, ky, kz;
+        vdouble4 orig[3];    // origin in the permuted axes
+        vgeometry4 shear[3]; // dir[kx] / dir[kz], dir[ky] / dir[kz], 1 / dir[kz]
+        ray_lanes() {}
+        ray_lanes(const ray &r)
+        {
+            vec3 d = r.direction();
+            kz = std::fabs(d.x()) > std::fabs(d.y()) ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                                                     : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            // keeps the winding, so edge functions of a hit all have the sign of the facing
+            if (d[kz] < 0)
+                std::swap(kx, ky);
+            orig[0] = vdouble4(r.origin()[kx]);
+            orig[1] = vdouble4(r.origin()[ky]);
+            orig[2] = vdouble4(r.origin()[kz]);
+            shear[0] = vgeometry4(d[kx] / d[kz]);
+            shear[1] = vgeometry4(d[ky] / d[kz]);
+            shear[2] = vgeometry4(1 / d[kz]);
+        }
+    };
+
+    unsigned int size() const { return num_triangles; }
+
+    void reserve(unsigned int n)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            v0[a].reserve(n + TRIANGLE_STORE_PADDING);
+            v1[a].reserve(n + TRIANGLE_STORE_PADDING);
+            v2[a].reserve(n + TRIANGLE_STORE_PADDING);
+            normal[a].reserve(n + TRIANGLE_STORE_PADDING);
+        }
+    }
+
+    void add(const point3 &p0, const point3 &p1, const point3 &p2)
+    {
+        vec3 n = cross(p1 - p0, p2 - p0);
+        n = n.near_zero() ? vec3(0, 0, 0) : unit_vector(n);
+        push(p0, p1, p2, n);
+        ++num_triangles;
+    }
+
+    // must be called after adding all triangles
+    void finalize()
+    {
+        for (int k = 0; k < TRIANGLE_STORE_PADDING; ++k)
+            push(vec3(), vec3(), vec3(), vec3());
+    }
+
+    vec3 face_normal(unsigned int i) const
+    {
+        return vec3(normal[0][i], normal[1][i], normal[2][i]);
+    }
+
+    point3 vertex(unsigned int i) const
+    {
+        return point3(v0[0][i], v0[1][i], v0[2][i]);
+    }
+
+    // edge 1 (v1 - v0) or 2 (v2 - v0) of triangle i
+    vec3 edge(int which, unsigned int i) const
+    {
+        const std::vector<float> *v = which == 1 ? v1 : v2;
+        return vec3(v[0][i], v[1][i], v[2][i]) - vertex(i);
+    }
+
+    /**
+     * Watertight test on SIMD_WIDTH triangles at a time against one ray
+     * @return: index of the closest triangle in [first, first + count) hit within (t_min, t_max), -1 on a miss
+     * @param t: distance to that triangle
+     * @param b1, b2: barycentric weights of its second and third vertex at the hit, see point
+    */
+    int intersect(unsigned int first, unsigned int count, const ray_lanes &rl, double t_min, double t_max,
+                  double &t, double &b1, double &b2) const
+    {
+        int closest = -1;
+        for (unsigned int i = first; i < first + count; i += SIMD_WIDTH)
+        {
+            vdouble4 lane_t, lane_v, lane_w, lane_determinant;
+            int mask = intersect_lanes(i, rl, t_min, t_max, lane_t, lane_v, lane_w, lane_determinant) & lane_mask(first + count - i);
+            if (!mask)
+                continue;
+            double ts[SIMD_WIDTH];
+            lane_t.store(ts);
+            int closest_lane = -1;
+            for (int k = 0; k < SIMD_WIDTH; ++k)
+            {
+                if ((mask >> k) & 1 && ts[k] < t_max)
+                {
+                    t_max = ts[k];
+                    closest_lane = k;
+                }
+            }
+            if (closest_lane < 0)
+                continue;
+            // the scaled barycentrics are only divided out for the closest lane
+            double vs[SIMD_WIDTH], ws[SIMD_WIDTH], determinants[SIMD_WIDTH];
+            lane_v.store(vs);
+            lane_w.store(ws);
+            lane_determinant.store(determinants);
+            closest = i + closest_lane;
+            b1 = vs[closest_lane] / determinants[closest_lane];
+            b2 = ws[closest_lane] / determinants[closest_lane];
+        }
+        t = t_max;
+        return closest;
+    }
+
+    /**
+     * Point of triangle i at barycentric weights b1, b2 of its second and third vertex.
+     * Interpolates the stored vertices in double, so the point lies on the triangle to double precision
+     * whatever lanes the kernel ran in, unlike the ray evaluated at the hit distance
+    */
+    point3 point(unsigned int i, double b1, double b2) const
+    {
+        return vertex(i) + b1 * edge(1, i) + b2 * edge(2, i);
+    }
+
+    /**
+     * Any hit version of intersect
+    */
+    bool occluded(unsigned int first, unsigned int count, const ray_lanes &rl, double t_min, double t_max) const
+    {
+        for (unsigned int i = first; i < first + count; i += SIMD_WIDTH)
+        {
+            vdouble4 lane_t, lane_v, lane_w, lane_determinant;
+            if (intersect_lanes(i, rl, t_min, t_max, lane_t, lane_v, lane_w, lane_determinant) & lane_mask(first + count - i))
+                return true;
+        }
+        return false;
+    }
+
+private:
+    unsigned int num_triangles = 0;
+
+    void push(const point3 &p0, const point3 &p1, const point3 &p2, const vec3 &n)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            v0[a].push_back(p0[a]);
+            v1[a].push_back(p1[a]);
+            v2[a].push_back(p2[a]);
+            normal[a].push_back(n[a]);
+        }
+    }
+
+    /**
+     * Vertex coordinates of triangles [i, i + SIMD_WIDTH) relative to the ray origin
+     * Subtracted in double before any rounding to float lanes, so that the error scales with
+     * the distance to the origin instead of the size of the coordinates
+    */
+    static vgeometry4 relative(const std::vector<float> &coordinate, unsigned int i, const vdouble4 &origin)
+    {
+        return to_vgeometry4(vdouble4::load(&coordinate[i]) - origin);
+    }
+
+    // x0 * y1 - y0 * x1 of two sheared vertices, evaluated in double with both products rounded
+    static vdouble4 edge_function(const vgeometry4 &x0, const vgeometry4 &y0, const vgeometry4 &x1, const vgeometry4 &y1)
+    {
+        return mul_unfused(to_vdouble4(x0), to_vdouble4(y1)) - mul_unfused(to_vdouble4(y0), to_vdouble4(x1));
+    }
+
+    // lanes of a SIMD_WIDTH group that still belong to the range
+    static int lane_mask(unsigned int remaining)
+    {
+        return remaining >= SIMD_WIDTH ? (1 << SIMD_WIDTH) - 1 : (1 << remaining) - 1;
+    }
+
+    /**
+     * Watertight test on triangles [i, i + SIMD_WIDTH)
+     * @return: mask of lanes hit within (t_min, t_max), t holds their distances, v and w the scaled barycentrics
+     *          of the second and third vertex and determinant their sum with the first one's
+    */
+    int intersect_lanes(unsigned int i, const ray_lanes &rl, double t_min, double t_max,
+                        vdouble4 &t, vdouble4 &v, vdouble4 &w, vdouble4 &determinant) const
+    {
+        // vertices relative to the origin, sheared so that the ray runs along +z. A vertex shared by two triangles
+        // may sit in different slots, so the shear must not be fused into an FMA in some slots only
+        vgeometry4 az = relative(v0[rl.kz], i, rl.orig[2]);
+        vgeometry4 bz = relative(v1[rl.kz], i, rl.orig[2]);
+        vgeometry4 cz = relative(v2[rl.kz], i, rl.orig[2]);
+        vgeometry4 ax = relative(v0[rl.kx], i, rl.orig[0]) - mul_unfused(rl.shear[0], az);
+        vgeometry4 ay = relative(v0[rl.ky], i, rl.orig[1]) - mul_unfused(rl.shear[1], az);
+        vgeometry4 bx = relative(v1[rl.kx], i, rl.orig[0]) - mul_unfused(rl.shear[0], bz);
+        vgeometry4 by = relative(v1[rl.ky], i, rl.orig[1]) - mul_unfused(rl.shear[1], bz);
+        vgeometry4 cx = relative(v2[rl.kx], i, rl.orig[0]) - mul_unfused(rl.shear[0], cz);
+        vgeometry4 cy = relative(v2[rl.ky], i, rl.orig[1]) - mul_unfused(rl.shear[1], cz);
+
+        // scaled barycentrics, the ray passes inside (or on the boundary) when all three have the same sign.
+        // Each one only depends on the two vertices of its edge, so neighbours agree on shared edges as long as
+        // it is computed exactly antisymmetric, which edge_function keeps by never fusing its products
+        vdouble4 u = edge_function(cx, cy, bx, by);
+        v = edge_function(ax, ay, cx, cy);
+        w = edge_function(bx, by, ax, ay);
+        vdouble4 zero(0.0);
+        int inside = movemask(((u >= zero) & (v >= zero) & (w >= zero)) | ((u <= zero) & (v <= zero) & (w <= zero)));
+        if (!inside)
+            return 0;
+        determinant = u + v + w;
+        t = (u * to_vdouble4(az) + v * to_vdouble4(bz) + w * to_vdouble4(cz)) * to_vdouble4(rl.shear[2]) / determinant;
+        return movemask((abs(determinant) > zero) & (t > t_min) & (t < t_max)) & inside;
+    }
+};
+
+#endif
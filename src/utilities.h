@@ -2,10 +2,10 @@
 #define UTILITIES_H
 
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
 #include <cstdlib>
-#include <random>
 #include "interval.h"
 
 
@@ -22,14 +22,84 @@ const double pi = 3.1415926535897932385;
 const double epsilon = 1e-8;
 // Utility Functions
 
+/**
+ * Multiple importance sampling weight of a sample drawn with density pdf_a
+ * when pdf_b is the density of the other strategy, power heuristic with beta = 2
+*/
+inline double power_heuristic(double pdf_a, double pdf_b) {
+    double a = pdf_a * pdf_a, b = pdf_b * pdf_b;
+    return a / (a + b);
+}
+
 inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+/**
+ * xoshiro256+ generator, small enough to live on the stack of every render thread.
+ * Seeded through splitmix64 so nearby seeds (e.g. neighbouring pixels) give unrelated streams
+*/
+class sampler {
+public:
+    sampler(uint64_t seed = 0) { set_seed(seed); }
+
+    void set_seed(uint64_t seed) {
+        for (int i = 0; i < 4; ++i)
+            state[i] = splitmix64(seed);
+    }
+
+    uint64_t next() {
+        uint64_t result = state[0] + state[3];
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 45);
+        return result;
+    }
+
+    // Returns a random real in [0,1) from the top 53 bits.
+    double next_double() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // Deterministic seed for one pixel, independent of which thread renders it.
+    static uint64_t pixel_seed(uint64_t seed, int i, int j, int pass = 0) {
+        uint64_t s = seed ^ (static_cast<uint64_t>(j) << 32 | static_cast<uint32_t>(i));
+        s = splitmix64(s);
+        return s ^ static_cast<uint64_t>(pass);
+    }
+
+private:
+    uint64_t state[4];
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    static uint64_t splitmix64(uint64_t &x) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+};
+
+inline double random_double(sampler &rng) {
+    return rng.next_double();
+}
+
+inline double random_double(sampler &rng, double min, double max) {
+    // Returns a random real in [min,max).
+    return min + (max-min)*random_double(rng);
+}
+
+// Per thread generator for code that has no sampler of its own (e.g. scene set up).
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    static thread_local sampler generator;
+    return random_double(generator);
 }
 
 inline double random_double(double min, double max) {
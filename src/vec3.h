@@ -3,59 +3,89 @@
 
 #include <cmath>
 #include <iostream>
+#include "simd.h"
 #include "utilities.h"
 
 using std::sqrt;
 
+/**
+ * With a simd backend the vector is padded to 4 lanes so the arithmetic and cross product
+ * are done on whole vdouble4 registers. The padding lane is never read, so it may hold anything.
+ * Lanes are loaded unaligned: C++11 new and std::vector do not honour alignment above 16 bytes,
+ * so the vectors are only aligned to 16.
+ * -DSCALAR_VEC3 (or -DDISABLE_SIMD) keeps the plain 3 double version
+*/
+#if SIMD_VECTORIZED && !defined(SCALAR_VEC3)
+#define VEC3_SIMD 1
+#endif
+
 class vec3
 {
 public:
+#if VEC3_SIMD
+    alignas(16) double e[4];
+#else
     double e[3];
+#endif
 
-    vec3()
-    {
-        e[0] = 0;
-        e[1] = 0;
-        e[2] = 0;
-    }
+    vec3() : vec3(0, 0, 0) {}
     vec3(double e0, double e1, double e2)
     {
         e[0] = e0;
         e[1] = e1;
         e[2] = e2;
+#if VEC3_SIMD
+        e[3] = 0;
+#endif
     }
+#if VEC3_SIMD
+    explicit vec3(const vdouble4 &v) { v.store(e); }
+    vdouble4 lanes() const { return vdouble4::load(e); }
+#endif
 
     double x() const { return e[0]; }
     double y() const { return e[1]; }
     double z() const { return e[2]; }
 
-    static vec3 random()
+    static vec3 random(sampler &rng)
     {
-        return vec3(random_double(), random_double(), random_double());
+        return vec3(random_double(rng), random_double(rng), random_double(rng));
     }
 
-    static vec3 random(double min, double max)
+    static vec3 random(sampler &rng, double min, double max)
     {
-        return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+        return vec3(random_double(rng, min, max), random_double(rng, min, max), random_double(rng, min, max));
     }
 
+#if VEC3_SIMD
+    vec3 operator-() const { return vec3(vdouble4(-1.0) * lanes()); }
+#else
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+#endif
     double operator[](int i) const { return e[i]; }
     double &operator[](int i) { return e[i]; }
 
     vec3 &operator+=(const vec3 &v)
     {
+#if VEC3_SIMD
+        (lanes() + v.lanes()).store(e);
+#else
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
+#endif
         return *this;
     }
 
     vec3 &operator*=(double t)
     {
+#if VEC3_SIMD
+        (lanes() * vdouble4(t)).store(e);
+#else
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
+#endif
         return *this;
     }
 
@@ -91,6 +121,12 @@ inline std::ostream &operator<<(std::ostream &out, const vec3 &v)
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
+#if VEC3_SIMD
+inline vec3 operator+(const vec3 &u, const vec3 &v) { return vec3(u.lanes() + v.lanes()); }
+inline vec3 operator-(const vec3 &u, const vec3 &v) { return vec3(u.lanes() - v.lanes()); }
+inline vec3 operator*(const vec3 &u, const vec3 &v) { return vec3(u.lanes() * v.lanes()); }
+inline vec3 operator*(double t, const vec3 &v) { return vec3(vdouble4(t) * v.lanes()); }
+#else
 inline vec3 operator+(const vec3 &u, const vec3 &v)
 {
     return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
@@ -110,6 +146,7 @@ inline vec3 operator*(double t, const vec3 &v)
 {
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
+#endif
 
 inline vec3 operator*(const vec3 &v, double t)
 {
@@ -121,24 +158,34 @@ inline vec3 operator/(vec3 v, double t)
     return (1 / t) * v;
 }
 
-inline double dot(const vec3 &u, const vec3 &v)
+#if VEC3_SIMD
+// u * v.yzx - u.yzx * v is the cross product in zxy order, one more rotation puts it back in xyz
+inline vec3 cross(const vec3 &u, const vec3 &v)
 {
-    return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
+    vdouble4 a = u.lanes(), b = v.lanes();
+    return vec3(rotate3(a * rotate3(b) - rotate3(a) * b));
 }
-
+#else
 inline vec3 cross(const vec3 &u, const vec3 &v)
 {
     return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
                 u.e[2] * v.e[0] - u.e[0] * v.e[2],
                 u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
+#endif
+
+// left scalar with the simd backend too: a chain of fmas is shorter than a horizontal add of the lanes
+inline double dot(const vec3 &u, const vec3 &v)
+{
+    return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
+}
 
 inline vec3 unit_vector(vec3 v)
 {
     return v / v.length();
 }
 
-vec3 reflect(const vec3 &v, const vec3 &n)
+inline vec3 reflect(const vec3 &v, const vec3 &n)
 {
     return v - 2 * dot(v, n) * n;
 }
@@ -151,36 +198,50 @@ inline vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat)
     return r_out_perp + r_out_parallel;
 }
 
-inline vec3 random_in_unit_sphere()
+inline vec3 random_in_unit_sphere(sampler &rng)
 {
     while (true)
     {
-        auto p = vec3::random(-1, 1);
+        auto p = vec3::random(rng, -1, 1);
         if (p.length_squared() < 1)
             return p;
     }
 }
 
-inline vec3 random_in_unit_disk() {
+inline vec3 random_in_unit_disk(sampler &rng) {
     while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
+        auto p = vec3(random_double(rng, -1,1), random_double(rng, -1,1), 0);
         if (p.length_squared() < 1)
             return p;
     }
 }
 
-inline vec3 random_unit_vector()
+inline vec3 random_unit_vector(sampler &rng)
 {
-    return unit_vector(random_in_unit_sphere());
+    return unit_vector(random_in_unit_sphere(rng));
 }
 
-inline vec3 random_on_hemisphere(const vec3 &normal)
+inline vec3 random_on_hemisphere(const vec3 &normal, sampler &rng)
 {
-    vec3 on_unit_sphere = random_unit_vector();
+    vec3 on_unit_sphere = random_unit_vector(rng);
     if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return on_unit_sphere;
     else
         return -on_unit_sphere;
 }
 
+/**
+ * Converts local coordinates (x, y, z) of the orthonormal basis with z along the unit vector w to world space
+ * Basis from Duff et al. "Building an Orthonormal Basis, Revisited"
+*/
+inline vec3 from_local(const vec3 &w, double x, double y, double z)
+{
+    double sign = std::copysign(1.0, w.z());
+    double a = -1.0 / (sign + w.z());
+    double b = w.x() * w.y() * a;
+    vec3 u(1.0 + sign * w.x() * w.x() * a, sign * b, -sign * w.x());
+    vec3 v(b, sign + w.y() * w.y() * a, -w.y());
+    return x * u + y * v + z * w;
+}
+
 #endif
\ No newline at end of file